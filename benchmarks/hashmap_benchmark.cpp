@@ -0,0 +1,706 @@
+/*
+ * Benchmark of HashMap against std::unordered_map.
+ *
+ * --mode=throughput (default): every combination of map, key type (int, string),
+ * key distribution (uniform, zipfian, sequential; see key_generator.h) and size runs
+ * the workloads:
+ *   insert     - insertion of all keys into an empty map;
+ *   find_hit   - lookups of present keys, chosen according to the distribution;
+ *   find_miss  - lookups of absent keys;
+ *   erase      - erasure of all keys from a full map;
+ *   iterate    - iteration over all elements;
+ *   upsert     - operator[] increments, starting from an empty map;
+ *   mixed      - find, find, operator[] increment and erase in turn on a full map.
+ * Small workloads are repeated until they make at least --min-ops operations; every
+ * workload is measured --repetitions times. Results are printed as JSON: time per operation
+ * of the best and of the average repetition, in nanoseconds.
+ *
+ * --mode=latency: every single operation is timed with steady_clock and recorded into
+ * a LatencyHistogram; results report p50/p99/p99.9/max. Workloads are:
+ *   insert     - insertion of all keys into an empty map (insert until N);
+ *   erase      - erasure of all keys from a full map (erase until empty);
+ *   churn      - a full map gets a new key and loses its oldest one, --min-ops times.
+ * Every key is touched once, so a distribution only selects the key values (zipfian keys
+ * are the uniform ones). Operations that changed the bucket count of the map (rehashes)
+ * are reported separately, together with the slowest of them. HashMapBackground is
+ * HashMap with background rehash enabled. Time of steady_clock::now() itself is reported
+ * as timer_overhead_ns and is included in all latencies.
+ *
+ * --mode=memory: keys are inserted one by one up to the largest of --sizes and then erased
+ * back to one key; memory of the map is sampled at sizes growing by kMemorySampleGrowth
+ * and at every size of --sizes, on both the way up ("grow") and down ("shrink"), so that
+ * bytes per element can be plotted against size and load factor. HashMap reports
+ * its memory_usage(), std::unordered_map is measured with a counting allocator; both add
+ * the same estimate of allocator overhead (see HashMapMemoryUsage) and neither counts
+ * heap memory of string keys.
+ *
+ * Usage: hashmap_benchmark [--mode=throughput|latency|memory] [--sizes=10,1000,...]
+ *        [--keys=int,string] [--distributions=uniform,zipfian,sequential]
+ *        [--maps=HashMap,HashMapBackground,FastHashMap,std] [--workloads=insert,...]
+ *        [--min-ops=N] [--repetitions=N] [--output=file]
+ * By default throughput mode uses HashMap, FastHashMap and std and all distributions,
+ * latency and memory modes use HashMap, HashMapBackground (latency) or FastHashMap
+ * (memory) and std, and uniform and sequential keys.
+ * Default sizes are 10 to 10^6; sizes up to 10^8 work, but string keys of 10^8 elements
+ * need tens of gigabytes of memory.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hashtable.h"
+#include "json_writer.h"
+#include "key_generator.h"
+#include "latency_histogram.h"
+
+namespace {
+
+// Empty lists of maps, workloads and distributions are replaced by defaults of the mode.
+struct Options {
+    std::string mode = "throughput";
+    std::vector<size_t> sizes = {10, 100, 1000, 10000, 100000, 1000000};
+    std::vector<std::string> keys = {"int", "string"};
+    std::vector<std::string> distributions;
+    std::vector<std::string> maps;
+    std::vector<std::string> workloads;
+    size_t min_ops = 1 << 20;
+    size_t repetitions = 3;
+    std::string output;
+};
+
+// Results of benchmarked operations are accumulated here, so that they are not optimized out.
+volatile uint64_t sink = 0;
+
+using Clock = std::chrono::steady_clock;
+
+double ElapsedNanoseconds(const Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+template<class Key, class Value>
+class BackgroundRehashMap : public HashMap<Key, Value> {
+  public:
+    BackgroundRehashMap() {
+        this->set_background_rehash(true);
+    }
+};
+
+template<class Key>
+struct Workload {
+    Distribution distribution;
+    std::vector<Key> keys;
+    std::vector<Key> missing_keys;
+    // Indexes of keys accessed by lookups and updates.
+    std::vector<uint32_t> accesses;
+    // Number of times workloads over all keys are repeated.
+    size_t rounds;
+};
+
+template<class Map, class Key>
+Map BuildMap(const std::vector<Key>& keys) {
+    Map map;
+    for (size_t ind = 0; ind < keys.size(); ++ind) {
+        map.insert({keys[ind], ind});
+    }
+    return map;
+}
+
+// Returns # of measured operations and their total time.
+template<class Map, class Key>
+std::pair<size_t, double> RunWorkload(const std::string& name, const Workload<Key>& workload) {
+    const std::vector<Key>& keys = workload.keys;
+    uint64_t checksum = 0;
+    if (name == "insert") {
+        Clock::time_point start = Clock::now();
+        for (size_t round = 0; round < workload.rounds; ++round) {
+            Map map;
+            for (size_t ind = 0; ind < keys.size(); ++ind) {
+                map.insert({keys[ind], ind});
+            }
+            checksum += map.size();
+        }
+        double time = ElapsedNanoseconds(start);
+        sink += checksum;
+        return {workload.rounds * keys.size(), time};
+    }
+    if (name == "erase") {
+        // Maps are copied in batches outside of measured time.
+        size_t batch_size = std::max<size_t>(1, std::min(workload.rounds,
+                                                         (1 << 22) / keys.size()));
+        Map original = BuildMap<Map>(keys);
+        double time = 0;
+        for (size_t round = 0; round < workload.rounds; round += batch_size) {
+            std::vector<Map> maps(std::min(batch_size, workload.rounds - round), original);
+            Clock::time_point start = Clock::now();
+            for (Map& map : maps) {
+                for (const Key& key : keys) {
+                    map.erase(key);
+                }
+                checksum += map.size();
+            }
+            time += ElapsedNanoseconds(start);
+        }
+        sink += checksum;
+        return {workload.rounds * keys.size(), time};
+    }
+    if (name == "upsert") {
+        Clock::time_point start = Clock::now();
+        Map map;
+        for (uint32_t index : workload.accesses) {
+            ++map[keys[index]];
+        }
+        double time = ElapsedNanoseconds(start);
+        sink += map.size();
+        return {workload.accesses.size(), time};
+    }
+
+    Map map = BuildMap<Map>(keys);
+    Clock::time_point start = Clock::now();
+    size_t operations = workload.accesses.size();
+    if (name == "find_hit") {
+        for (uint32_t index : workload.accesses) {
+            checksum += map.find(keys[index])->second;
+        }
+    } else if (name == "find_miss") {
+        const std::vector<Key>& missing_keys = workload.missing_keys;
+        for (size_t ind = 0; ind < operations; ++ind) {
+            checksum += map.find(missing_keys[ind % missing_keys.size()]) == map.end();
+        }
+    } else if (name == "iterate") {
+        for (size_t round = 0; round < workload.rounds; ++round) {
+            for (const auto& element : map) {
+                checksum += element.second;
+            }
+        }
+        operations = workload.rounds * keys.size();
+    } else if (name == "mixed") {
+        for (size_t ind = 0; ind < operations; ++ind) {
+            const Key& key = keys[workload.accesses[ind]];
+            switch (ind % 4) {
+                case 0:
+                case 1:
+                    checksum += map.find(key) != map.end();
+                    break;
+                case 2:
+                    ++map[key];
+                    break;
+                default:
+                    map.erase(key);
+            }
+        }
+    } else {
+        throw std::invalid_argument("Unknown workload: " + name);
+    }
+    double time = ElapsedNanoseconds(start);
+    sink += checksum;
+    return {operations, time};
+}
+
+template<class Map, class Key>
+void RunMap(const std::string& map_name, const Workload<Key>& workload,
+            const Options& options, std::vector<JsonObject>& results) {
+    for (const std::string& workload_name : options.workloads) {
+        size_t operations = 0;
+        double best_time = 0;
+        double total_time = 0;
+        for (size_t repetition = 0; repetition < options.repetitions; ++repetition) {
+            std::pair<size_t, double> measurement = RunWorkload<Map>(workload_name, workload);
+            operations = measurement.first;
+            best_time = repetition == 0 ? measurement.second :
+                        std::min(best_time, measurement.second);
+            total_time += measurement.second;
+        }
+        results.push_back(JsonObject()
+                          .Add("map", map_name)
+                          .Add("key", KeyTraits<Key>::Name())
+                          .Add("distribution", DistributionName(workload.distribution))
+                          .Add("size", workload.keys.size())
+                          .Add("workload", workload_name)
+                          .Add("operations", operations)
+                          .Add("best_ns_per_op", best_time / operations)
+                          .Add("mean_ns_per_op",
+                               total_time / options.repetitions / operations));
+        std::cerr << map_name << " " << KeyTraits<Key>::Name() << " "
+                  << DistributionName(workload.distribution) << " " << workload.keys.size()
+                  << " " << workload_name << ": " << best_time / operations << " ns/op\n";
+    }
+}
+
+// Minimal time between two consecutive reads of the clock.
+uint64_t MeasureTimerOverhead() {
+    uint64_t overhead = UINT64_MAX;
+    for (size_t ind = 0; ind < 1000; ++ind) {
+        Clock::time_point start = Clock::now();
+        uint64_t elapsed = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start)
+                        .count());
+        overhead = std::min(overhead, elapsed);
+    }
+    return overhead;
+}
+
+// Operation that changed the bucket count of the map.
+struct RehashEvent {
+    size_t operation;
+    uint64_t nanoseconds;
+    size_t old_bucket_count;
+    size_t new_bucket_count;
+};
+
+class LatencyRecorder {
+  public:
+    constexpr static size_t kReportedRehashes = 10;
+
+    // Times a single operation on the map.
+    template<class Map, class Operation>
+    void Measure(const Map& map, Operation operation) {
+        size_t old_bucket_count = map.bucket_count();
+        Clock::time_point start = Clock::now();
+        operation();
+        Clock::time_point finish = Clock::now();
+        uint64_t nanoseconds = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count());
+        all_.Record(nanoseconds);
+        if (map.bucket_count() == old_bucket_count) {
+            other_.Record(nanoseconds);
+        } else {
+            rehashes_.Record(nanoseconds);
+            slowest_rehashes_.push_back({operations_, nanoseconds, old_bucket_count,
+                                         map.bucket_count()});
+            if (slowest_rehashes_.size() >= 4 * kReportedRehashes) {
+                KeepSlowestRehashes();
+            }
+        }
+        ++operations_;
+    }
+
+    void Report(JsonObject& result) {
+        KeepSlowestRehashes();
+        std::vector<JsonObject> slowest_rehashes;
+        for (const RehashEvent& event : slowest_rehashes_) {
+            slowest_rehashes.push_back(JsonObject()
+                                       .Add("operation", event.operation)
+                                       .Add("ns", event.nanoseconds)
+                                       .Add("old_bucket_count", event.old_bucket_count)
+                                       .Add("new_bucket_count", event.new_bucket_count));
+        }
+        result.Add("operations", all_.count())
+              .Add("p50_ns", all_.Percentile(50))
+              .Add("p99_ns", all_.Percentile(99))
+              .Add("p99.9_ns", all_.Percentile(99.9))
+              .Add("max_ns", all_.max())
+              .Add("mean_ns", all_.mean())
+              .Add("non_rehash_p99.9_ns", other_.Percentile(99.9))
+              .Add("non_rehash_max_ns", other_.max())
+              .Add("rehash_operations", rehashes_.count())
+              .Add("rehash_p50_ns", rehashes_.Percentile(50))
+              .Add("rehash_max_ns", rehashes_.max())
+              .Add("slowest_rehashes", slowest_rehashes);
+    }
+
+  private:
+    void KeepSlowestRehashes() {
+        std::sort(slowest_rehashes_.begin(), slowest_rehashes_.end(),
+                  [](const RehashEvent& first, const RehashEvent& second) {
+                      return first.nanoseconds > second.nanoseconds;
+                  });
+        if (slowest_rehashes_.size() > kReportedRehashes) {
+            slowest_rehashes_.resize(kReportedRehashes);
+        }
+    }
+
+  private:
+    LatencyHistogram all_;
+    LatencyHistogram other_;
+    LatencyHistogram rehashes_;
+    std::vector<RehashEvent> slowest_rehashes_;
+    size_t operations_ = 0;
+};
+
+template<class Map, class Key>
+void RunLatencyWorkload(const std::string& name, const std::vector<Key>& keys,
+                        const Distribution distribution, const Options& options,
+                        LatencyRecorder& recorder) {
+    size_t rounds = std::max<size_t>(1, options.min_ops / keys.size());
+    if (name == "insert") {
+        for (size_t round = 0; round < rounds; ++round) {
+            Map map;
+            for (size_t ind = 0; ind < keys.size(); ++ind) {
+                recorder.Measure(map, [&]() { map.insert({keys[ind], ind}); });
+            }
+            sink += map.size();
+        }
+    } else if (name == "erase") {
+        Map original = BuildMap<Map>(keys);
+        for (size_t round = 0; round < rounds; ++round) {
+            Map map = original;
+            for (const Key& key : keys) {
+                recorder.Measure(map, [&]() { map.erase(key); });
+            }
+            sink += map.size();
+        }
+    } else if (name == "churn") {
+        Map map = BuildMap<Map>(keys);
+        size_t operations = std::max(keys.size(), options.min_ops);
+        for (size_t ind = 0; ind < operations; ++ind) {
+            Key new_key = MakeKey<Key>(keys.size() + ind, distribution);
+            Key old_key = MakeKey<Key>(ind, distribution);
+            recorder.Measure(map, [&]() { map.insert({std::move(new_key), ind}); });
+            recorder.Measure(map, [&]() { map.erase(old_key); });
+        }
+        sink += map.size();
+    } else {
+        throw std::invalid_argument("Unknown workload: " + name);
+    }
+}
+
+template<class Map, class Key>
+void RunLatencyMap(const std::string& map_name, const std::vector<Key>& keys,
+                   const Distribution distribution, const Options& options,
+                   std::vector<JsonObject>& results) {
+    uint64_t timer_overhead = MeasureTimerOverhead();
+    for (const std::string& workload_name : options.workloads) {
+        LatencyRecorder recorder;
+        RunLatencyWorkload<Map>(workload_name, keys, distribution, options, recorder);
+        JsonObject result;
+        result.Add("map", map_name)
+              .Add("key", KeyTraits<Key>::Name())
+              .Add("distribution", DistributionName(distribution))
+              .Add("size", keys.size())
+              .Add("workload", workload_name)
+              .Add("timer_overhead_ns", timer_overhead);
+        recorder.Report(result);
+        results.push_back(result);
+        std::cerr << map_name << " " << KeyTraits<Key>::Name() << " "
+                  << DistributionName(distribution) << " " << keys.size() << " "
+                  << workload_name << " done\n";
+    }
+}
+
+template<class Key>
+void RunLatency(const Options& options, std::vector<JsonObject>& results) {
+    for (const std::string& distribution_name : options.distributions) {
+        Distribution distribution = ParseDistribution(distribution_name);
+        for (size_t size : options.sizes) {
+            std::vector<Key> keys = MakeKeys<Key>(0, size, distribution);
+            for (const std::string& map_name : options.maps) {
+                if (map_name == "HashMap") {
+                    RunLatencyMap<HashMap<Key, uint64_t>>(map_name, keys, distribution,
+                                                          options, results);
+                } else if (map_name == "HashMapBackground") {
+                    RunLatencyMap<BackgroundRehashMap<Key, uint64_t>>(
+                            map_name, keys, distribution, options, results);
+                } else if (map_name == "FastHashMap") {
+                    RunLatencyMap<FastHashMap<Key, uint64_t>>(map_name, keys, distribution,
+                                                              options, results);
+                } else if (map_name == "std") {
+                    RunLatencyMap<std::unordered_map<Key, uint64_t>>(
+                            "std::unordered_map", keys, distribution, options, results);
+                } else {
+                    throw std::invalid_argument("Unknown map: " + map_name);
+                }
+            }
+        }
+    }
+}
+
+// Net heap usage of all CountingAllocator instances.
+struct AllocationCounter {
+    size_t bytes = 0;
+    size_t blocks = 0;
+    size_t overhead_bytes = 0;
+};
+
+AllocationCounter allocation_counter;
+
+template<class T>
+class CountingAllocator {
+  public:
+    using value_type = T;
+
+    CountingAllocator() = default;
+
+    template<class Other>
+    CountingAllocator(const CountingAllocator<Other>&) {}
+
+    T* allocate(const size_t count) {
+        size_t bytes = count * sizeof(T);
+        allocation_counter.bytes += bytes;
+        ++allocation_counter.blocks;
+        allocation_counter.overhead_bytes += HashMapMemoryUsage::EstimateAllocatorOverhead(bytes);
+        return static_cast<T*>(::operator new(bytes));
+    }
+
+    void deallocate(T* pointer, const size_t count) {
+        size_t bytes = count * sizeof(T);
+        allocation_counter.bytes -= bytes;
+        --allocation_counter.blocks;
+        allocation_counter.overhead_bytes -= HashMapMemoryUsage::EstimateAllocatorOverhead(bytes);
+        ::operator delete(pointer);
+    }
+
+    template<class Other>
+    bool operator==(const CountingAllocator<Other>&) const {
+        return true;
+    }
+
+    template<class Other>
+    bool operator!=(const CountingAllocator<Other>&) const {
+        return false;
+    }
+};
+
+template<class Key, class Value>
+using CountingUnorderedMap = std::unordered_map<Key, Value, std::hash<Key>, std::equal_to<Key>,
+                                                CountingAllocator<std::pair<const Key, Value>>>;
+
+// Growth factor of sizes at which memory is sampled.
+constexpr double kMemorySampleGrowth = 1.1;
+
+template<class Key, class Value, class Hash, class Equal>
+void AddMemoryUsage(const HashMap<Key, Value, Hash, Equal>& map, JsonObject& result) {
+    HashMapMemoryUsage usage = map.memory_usage();
+    result.Add("total_bytes", usage.total_bytes)
+          .Add("bytes_per_element", static_cast<double>(usage.total_bytes) / map.size())
+          .Add("allocator_overhead_bytes", usage.allocator_overhead_bytes)
+          .Add("data_used_bytes", usage.data_used_bytes)
+          .Add("data_allocated_bytes", usage.data_allocated_bytes)
+          .Add("table_bytes", usage.table_bytes)
+          .Add("bucket_bytes", usage.bucket_bytes)
+          .Add("bucket_allocations", usage.bucket_allocations)
+          .Add("long_bucket_bytes", usage.long_bucket_bytes);
+}
+
+template<class Key, class Value>
+void AddMemoryUsage(const CountingUnorderedMap<Key, Value>& map, JsonObject& result) {
+    size_t total_bytes = sizeof(map) + allocation_counter.bytes +
+                         allocation_counter.overhead_bytes;
+    result.Add("total_bytes", total_bytes)
+          .Add("bytes_per_element", static_cast<double>(total_bytes) / map.size())
+          .Add("allocator_overhead_bytes", allocation_counter.overhead_bytes)
+          .Add("heap_bytes", allocation_counter.bytes)
+          .Add("heap_allocations", allocation_counter.blocks);
+}
+
+template<class Map, class Key>
+void RunMemoryMap(const std::string& map_name, const std::vector<Key>& keys,
+                  const Distribution distribution, const Options& options,
+                  std::vector<JsonObject>& results) {
+    std::vector<bool> sampled(keys.size() + 1);
+    for (double size = 1; size <= keys.size(); size = std::max(size * kMemorySampleGrowth,
+                                                               size + 1)) {
+        sampled[static_cast<size_t>(size)] = true;
+    }
+    for (size_t size : options.sizes) {
+        sampled[size] = true;
+    }
+    auto sample = [&](const Map& map, const char* phase) {
+        JsonObject result;
+        result.Add("map", map_name)
+              .Add("key", KeyTraits<Key>::Name())
+              .Add("distribution", DistributionName(distribution))
+              .Add("phase", phase)
+              .Add("size", map.size())
+              .Add("bucket_count", map.bucket_count())
+              .Add("load_factor", static_cast<double>(map.size()) / map.bucket_count())
+              .Add("element_bytes", sizeof(std::pair<Key, uint64_t>));
+        AddMemoryUsage(map, result);
+        results.push_back(result);
+    };
+    Map map;
+    for (size_t ind = 0; ind < keys.size(); ++ind) {
+        map.insert({keys[ind], ind});
+        if (sampled[map.size()]) {
+            sample(map, "grow");
+        }
+    }
+    for (size_t ind = 0; ind + 1 < keys.size(); ++ind) {
+        map.erase(keys[ind]);
+        if (sampled[map.size()]) {
+            sample(map, "shrink");
+        }
+    }
+    std::cerr << map_name << " " << KeyTraits<Key>::Name() << " "
+              << DistributionName(distribution) << " " << keys.size() << " done\n";
+}
+
+template<class Key>
+void RunMemory(const Options& options, std::vector<JsonObject>& results) {
+    size_t max_size = *std::max_element(options.sizes.begin(), options.sizes.end());
+    for (const std::string& distribution_name : options.distributions) {
+        Distribution distribution = ParseDistribution(distribution_name);
+        std::vector<Key> keys = MakeKeys<Key>(0, max_size, distribution);
+        for (const std::string& map_name : options.maps) {
+            if (map_name == "HashMap") {
+                RunMemoryMap<HashMap<Key, uint64_t>>(map_name, keys, distribution, options,
+                                                     results);
+            } else if (map_name == "HashMapBackground") {
+                RunMemoryMap<BackgroundRehashMap<Key, uint64_t>>(map_name, keys, distribution,
+                                                                 options, results);
+            } else if (map_name == "FastHashMap") {
+                RunMemoryMap<FastHashMap<Key, uint64_t>>(map_name, keys, distribution,
+                                                         options, results);
+            } else if (map_name == "std") {
+                RunMemoryMap<CountingUnorderedMap<Key, uint64_t>>(
+                        "std::unordered_map", keys, distribution, options, results);
+            } else {
+                throw std::invalid_argument("Unknown map: " + map_name);
+            }
+        }
+    }
+}
+
+template<class Key>
+void RunThroughput(const Options& options, std::vector<JsonObject>& results) {
+    for (const std::string& distribution_name : options.distributions) {
+        Distribution distribution = ParseDistribution(distribution_name);
+        for (size_t size : options.sizes) {
+            Workload<Key> workload;
+            workload.distribution = distribution;
+            workload.keys = MakeKeys<Key>(0, size, distribution);
+            workload.missing_keys = MakeKeys<Key>(size, 2 * size, distribution);
+            workload.accesses = IndexGenerator(distribution, size, size)
+                    .Generate(std::max(size, options.min_ops));
+            workload.rounds = std::max<size_t>(1, options.min_ops / size);
+            for (const std::string& map_name : options.maps) {
+                if (map_name == "HashMap") {
+                    RunMap<HashMap<Key, uint64_t>>(map_name, workload, options, results);
+                } else if (map_name == "HashMapBackground") {
+                    RunMap<BackgroundRehashMap<Key, uint64_t>>(map_name, workload, options,
+                                                               results);
+                } else if (map_name == "FastHashMap") {
+                    RunMap<FastHashMap<Key, uint64_t>>(map_name, workload, options, results);
+                } else if (map_name == "std") {
+                    RunMap<std::unordered_map<Key, uint64_t>>("std::unordered_map", workload,
+                                                              options, results);
+                } else {
+                    throw std::invalid_argument("Unknown map: " + map_name);
+                }
+            }
+        }
+    }
+}
+
+std::vector<std::string> SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = std::min(list.find(',', begin), list.size());
+        if (end > begin) {
+            items.push_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return items;
+}
+
+std::vector<size_t> ParseSizes(const std::string& list) {
+    std::vector<size_t> sizes;
+    for (const std::string& item : SplitList(list)) {
+        size_t size = std::stoull(item);
+        if (size == 0 || size > UINT32_MAX) {
+            throw std::invalid_argument("Size must be in [1, 2^32): " + item);
+        }
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+template<class Key>
+void RunMode(const Options& options, std::vector<JsonObject>& results) {
+    if (options.mode == "latency") {
+        RunLatency<Key>(options, results);
+    } else if (options.mode == "memory") {
+        RunMemory<Key>(options, results);
+    } else {
+        RunThroughput<Key>(options, results);
+    }
+}
+
+void SetDefault(std::vector<std::string>& list, const std::vector<std::string>& defaults) {
+    if (list.empty()) {
+        list = defaults;
+    }
+}
+
+Options ParseOptions(int argc, char** argv) {
+    Options options;
+    std::map<std::string, std::function<void(const std::string&)>> parsers = {
+        {"--mode", [&](const std::string& value) { options.mode = value; }},
+        {"--sizes", [&](const std::string& value) { options.sizes = ParseSizes(value); }},
+        {"--keys", [&](const std::string& value) { options.keys = SplitList(value); }},
+        {"--distributions",
+         [&](const std::string& value) { options.distributions = SplitList(value); }},
+        {"--maps", [&](const std::string& value) { options.maps = SplitList(value); }},
+        {"--workloads", [&](const std::string& value) { options.workloads = SplitList(value); }},
+        {"--min-ops", [&](const std::string& value) { options.min_ops = std::stoull(value); }},
+        {"--repetitions",
+         [&](const std::string& value) {
+             options.repetitions = std::max<size_t>(1, std::stoull(value));
+         }},
+        {"--output", [&](const std::string& value) { options.output = value; }},
+    };
+    for (int ind = 1; ind < argc; ++ind) {
+        std::string argument = argv[ind];
+        size_t separator = argument.find('=');
+        auto parser = parsers.find(argument.substr(0, separator));
+        if (parser == parsers.end() || separator == std::string::npos) {
+            throw std::invalid_argument("Unknown argument: " + argument);
+        }
+        parser->second(argument.substr(separator + 1));
+    }
+    if (options.mode == "throughput") {
+        SetDefault(options.maps, {"HashMap", "FastHashMap", "std"});
+        SetDefault(options.distributions, {"uniform", "zipfian", "sequential"});
+        SetDefault(options.workloads, {"insert", "find_hit", "find_miss", "erase", "iterate",
+                                       "upsert", "mixed"});
+    } else if (options.mode == "latency") {
+        SetDefault(options.maps, {"HashMap", "HashMapBackground", "std"});
+        SetDefault(options.distributions, {"uniform", "sequential"});
+        SetDefault(options.workloads, {"insert", "erase", "churn"});
+    } else if (options.mode == "memory") {
+        SetDefault(options.maps, {"HashMap", "FastHashMap", "std"});
+        SetDefault(options.distributions, {"uniform", "sequential"});
+    } else {
+        throw std::invalid_argument("Unknown mode: " + options.mode);
+    }
+    return options;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    try {
+        Options options = ParseOptions(argc, argv);
+        std::vector<JsonObject> results;
+        for (const std::string& key : options.keys) {
+            if (key == "int") {
+                RunMode<uint64_t>(options, results);
+            } else if (key == "string") {
+                RunMode<std::string>(options, results);
+            } else {
+                throw std::invalid_argument("Unknown key type: " + key);
+            }
+        }
+        JsonObject report;
+        report.Add("benchmark", options.mode).Add("results", results);
+        if (options.output.empty()) {
+            std::cout << report << "\n";
+        } else {
+            std::ofstream(options.output) << report << "\n";
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Minimal builder of JSON objects for benchmark reports: fields are written in the order
+ * they are added, values are strings, numbers, nested objects or arrays of them.
+ */
+class JsonObject {
+  public:
+    JsonObject& Add(const std::string& name, const std::string& value) {
+        return AddRaw(name, Quote(value));
+    }
+
+    JsonObject& Add(const std::string& name, const char* value) {
+        return AddRaw(name, Quote(value));
+    }
+
+    JsonObject& Add(const std::string& name, const bool value) {
+        return AddRaw(name, value ? "true" : "false");
+    }
+
+    JsonObject& Add(const std::string& name, const uint64_t value) {
+        return AddRaw(name, std::to_string(value));
+    }
+
+    JsonObject& Add(const std::string& name, const double value) {
+        if (!std::isfinite(value)) {
+            return AddRaw(name, "null");
+        }
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+        return AddRaw(name, buffer);
+    }
+
+    JsonObject& Add(const std::string& name, const JsonObject& value) {
+        return AddRaw(name, value.str());
+    }
+
+    JsonObject& Add(const std::string& name, const std::vector<JsonObject>& values) {
+        std::string array = "[";
+        for (size_t ind = 0; ind < values.size(); ++ind) {
+            array += (ind == 0 ? "\n  " : ",\n  ") + values[ind].str();
+        }
+        return AddRaw(name, array + (values.empty() ? "]" : "\n]"));
+    }
+
+    template<class Number>
+    JsonObject& Add(const std::string& name, const std::vector<Number>& values) {
+        std::string array = "[";
+        for (size_t ind = 0; ind < values.size(); ++ind) {
+            array += (ind == 0 ? "" : ",") + std::to_string(values[ind]);
+        }
+        return AddRaw(name, array + "]");
+    }
+
+    std::string str() const {
+        return "{" + fields_ + "}";
+    }
+
+  private:
+    JsonObject& AddRaw(const std::string& name, const std::string& value) {
+        if (!fields_.empty()) {
+            fields_ += ", ";
+        }
+        fields_ += Quote(name) + ": " + value;
+        return *this;
+    }
+
+    static std::string Quote(const std::string& value) {
+        std::string result = "\"";
+        for (char symbol : value) {
+            if (symbol == '"' || symbol == '\\') {
+                result += '\\';
+                result += symbol;
+            } else if (static_cast<unsigned char>(symbol) < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", symbol);
+                result += buffer;
+            } else {
+                result += symbol;
+            }
+        }
+        return result + "\"";
+    }
+
+  private:
+    std::string fields_;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const JsonObject& object) {
+    return out << object.str();
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Keys and access patterns of benchmarks.
+ * A benchmark of size N works with keys MakeKey(0), ..., MakeKey(N - 1); keys
+ * MakeKey(N), ..., MakeKey(2N - 1) are never inserted and are used for failed lookups.
+ * With the sequential distribution keys are consecutive integers accessed in order;
+ * otherwise they are scrambled by a bijective mixer (so they are distinct) and accessed
+ * uniformly at random or with Zipfian skew (rank 0 being the hottest key).
+ */
+enum class Distribution {
+    kUniform,
+    kZipfian,
+    kSequential
+};
+
+inline const char* DistributionName(const Distribution distribution) {
+    switch (distribution) {
+        case Distribution::kUniform:
+            return "uniform";
+        case Distribution::kZipfian:
+            return "zipfian";
+        case Distribution::kSequential:
+            return "sequential";
+    }
+    return "unknown";
+}
+
+inline Distribution ParseDistribution(const std::string& name) {
+    for (Distribution distribution : {Distribution::kUniform, Distribution::kZipfian,
+                                      Distribution::kSequential}) {
+        if (name == DistributionName(distribution)) {
+            return distribution;
+        }
+    }
+    throw std::invalid_argument("Unknown distribution: " + name);
+}
+
+// Bijection on 64-bit integers (finalizer of splitmix64).
+inline uint64_t Scramble(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+template<class Key>
+struct KeyTraits;
+
+template<>
+struct KeyTraits<uint64_t> {
+    static const char* Name() {
+        return "int";
+    }
+
+    static uint64_t Make(const uint64_t value) {
+        return value;
+    }
+};
+
+// 20-character strings, long enough to defeat small string optimization.
+template<>
+struct KeyTraits<std::string> {
+    static const char* Name() {
+        return "string";
+    }
+
+    static std::string Make(const uint64_t value) {
+        char buffer[24];
+        std::snprintf(buffer, sizeof(buffer), "key-%016llx",
+                      static_cast<unsigned long long>(value));
+        return buffer;
+    }
+};
+
+template<class Key>
+Key MakeKey(const uint64_t index, const Distribution distribution) {
+    return KeyTraits<Key>::Make(distribution == Distribution::kSequential ?
+                                index : Scramble(index));
+}
+
+template<class Key>
+std::vector<Key> MakeKeys(const size_t begin, const size_t end,
+                          const Distribution distribution) {
+    std::vector<Key> keys;
+    keys.reserve(end - begin);
+    for (size_t index = begin; index < end; ++index) {
+        keys.push_back(MakeKey<Key>(index, distribution));
+    }
+    return keys;
+}
+
+/*
+ * Generates indexes of accessed keys among size keys.
+ * Zipfian generator is the one of YCSB (Gray et al., "Quickly generating billion-record
+ * synthetic databases"): O(size) setup, O(1) per index.
+ */
+class IndexGenerator {
+  public:
+    constexpr static double kZipfianConstant = 0.99;
+
+    IndexGenerator(const Distribution distribution, const size_t size, const uint64_t seed) :
+            distribution_(distribution), size_(size), random_(seed) {
+        if (distribution_ != Distribution::kZipfian) {
+            return;
+        }
+        for (size_t rank = 1; rank <= size_; ++rank) {
+            zeta_ += 1 / std::pow(static_cast<double>(rank), kZipfianConstant);
+        }
+        double zeta2 = 1 + 1 / std::pow(2.0, kZipfianConstant);
+        alpha_ = 1 / (1 - kZipfianConstant);
+        eta_ = (1 - std::pow(2.0 / size_, 1 - kZipfianConstant)) / (1 - zeta2 / zeta_);
+    }
+
+    size_t Next() {
+        switch (distribution_) {
+            case Distribution::kSequential:
+                return next_++ % size_;
+            case Distribution::kUniform:
+                return std::uniform_int_distribution<size_t>(0, size_ - 1)(random_);
+            case Distribution::kZipfian:
+                return NextZipfian();
+        }
+        return 0;
+    }
+
+    // Indexes of count accesses.
+    std::vector<uint32_t> Generate(const size_t count) {
+        std::vector<uint32_t> indexes(count);
+        for (uint32_t& index : indexes) {
+            index = static_cast<uint32_t>(Next());
+        }
+        return indexes;
+    }
+
+  private:
+    size_t NextZipfian() {
+        double uniform = std::uniform_real_distribution<double>(0, 1)(random_);
+        double scaled = uniform * zeta_;
+        if (scaled < 1 || size_ == 1) {
+            return 0;
+        }
+        if (scaled < 1 + std::pow(0.5, kZipfianConstant)) {
+            return 1;
+        }
+        size_t rank = static_cast<size_t>(size_ * std::pow(eta_ * uniform - eta_ + 1, alpha_));
+        return rank < size_ ? rank : size_ - 1;
+    }
+
+  private:
+    Distribution distribution_;
+    size_t size_;
+    std::mt19937_64 random_;
+    size_t next_ = 0;
+    double zeta_ = 0;
+    double alpha_ = 0;
+    double eta_ = 0;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+ * HDR-style histogram of latencies (any non-negative integer values).
+ * Values below 2^kSubBucketBits are counted exactly; larger values are grouped into
+ * 2^kSubBucketBits buckets per power of two, so a reported value differs from the recorded
+ * one by less than 2^-kSubBucketBits (about 3%). Memory is fixed, recording is O(1).
+ */
+class LatencyHistogram {
+  public:
+    constexpr static int kSubBucketBits = 5;
+    constexpr static uint64_t kSubBucketCount = 1ULL << kSubBucketBits;
+
+    LatencyHistogram() : counts_(BucketIndex(UINT64_MAX) + 1) {}
+
+    void Record(const uint64_t value) {
+        ++counts_[BucketIndex(value)];
+        ++count_;
+        sum_ += static_cast<double>(value);
+        max_ = std::max(max_, value);
+    }
+
+    // Smallest recorded value such that at least percentile % of values are not greater,
+    // up to the precision of the histogram (highest value of its bucket, but not above max).
+    uint64_t Percentile(const double percentile) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(percentile / 100 * count_));
+        rank = std::min(std::max<uint64_t>(rank, 1), count_);
+        uint64_t seen = 0;
+        for (size_t index = 0; index < counts_.size(); ++index) {
+            seen += counts_[index];
+            if (seen >= rank) {
+                return std::min(BucketUpperBound(index), max_);
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+
+    uint64_t max() const {
+        return max_;
+    }
+
+    double mean() const {
+        return count_ == 0 ? 0 : sum_ / count_;
+    }
+
+  private:
+    static size_t BucketIndex(const uint64_t value) {
+        if (value < kSubBucketCount) {
+            return value;
+        }
+        int exponent = 63 - CountLeadingZeros(value);
+        int shift = exponent - kSubBucketBits;
+        return ((static_cast<size_t>(shift) + 1) << kSubBucketBits) +
+               static_cast<size_t>(value >> shift) - kSubBucketCount;
+    }
+
+    static uint64_t BucketUpperBound(const size_t index) {
+        if (index < kSubBucketCount) {
+            return index;
+        }
+        int shift = static_cast<int>(index >> kSubBucketBits) - 1;
+        uint64_t mantissa = (index & (kSubBucketCount - 1)) + kSubBucketCount;
+        // Highest bucket ends at UINT64_MAX, computing its bound would overflow.
+        if (mantissa + 1 > (UINT64_MAX >> shift)) {
+            return UINT64_MAX;
+        }
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    static int CountLeadingZeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clzll(value);
+#else
+        int zeros = 0;
+        for (uint64_t bit = 1ULL << 63; (value & bit) == 0; bit >>= 1) {
+            ++zeros;
+        }
+        return zeros;
+#endif
+    }
+
+  private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    double sum_ = 0;
+    uint64_t max_ = 0;
+};
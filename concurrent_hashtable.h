@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+
+#include "hash.h"
+#include "hashtable.h"
+
+/*
+ * Thread-safe hash map that splits keys between shard_count independent HashMaps (shards),
+ * each of them protected by its own std::shared_mutex, so operations on different shards
+ * never wait for each other and lookups in the same shard run concurrently.
+ * Shard of a key is chosen by the high bits of its hash (mixed with IntegerHash first,
+ * so hash functions with poor high bits, e.g. identity std::hash for integers, still spread
+ * keys evenly); buckets inside a shard are chosen by hash % # of buckets, so these two
+ * choices stay independent. Key is hashed once: its hash is passed to the shard as
+ * PrehashedKey, and the shard recomputes it only if it has reseeded its hash function.
+ * As references into a shard can't outlive its lock, the interface is value-based:
+ * find returns a copy of the value and in-place modification is done with update.
+ * shard_count is rounded up to a power of two.
+ */
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+         class KeyEqual = std::equal_to<KeyType>>
+class ConcurrentHashMap {
+  public:
+    constexpr static size_t kDefaultShardCount = 64;
+
+    using Map = HashMap<KeyType, ValueType, Hash, KeyEqual>;
+    using KeyValuePair = typename Map::KeyValuePair;
+
+  public:
+    // Complexity: O(shard_count) guaranteed.
+    explicit ConcurrentHashMap(const size_t shard_count = kDefaultShardCount,
+                               const Hash& hasher_ = Hash(),
+                               const KeyEqual& key_equal_ = KeyEqual()) : hasher_(hasher_) {
+        while ((static_cast<size_t>(1) << shard_bits_) < shard_count) {
+            ++shard_bits_;
+        }
+        shards_.reset(new Shard[static_cast<size_t>(1) << shard_bits_]);
+        for (size_t ind = 0; ind < this->shard_count(); ++ind) {
+            shards_[ind].map = Map(hasher_, key_equal_);
+        }
+    }
+
+    // Complexity: O(1) guaranteed.
+    size_t shard_count() const {
+        return static_cast<size_t>(1) << shard_bits_;
+    }
+
+    // Complexity: O(1) guaranteed.
+    Hash hash_function() const {
+        return hasher_;
+    }
+
+    // Complexity: O(1) guaranteed.
+    KeyEqual key_eq() const {
+        return shards_[0].map.key_eq();
+    }
+
+    // Returns copy of the value with key == Key if it exists.
+    // Complexity: O(1) average case.
+    std::optional<ValueType> find(const KeyType& key) const {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        const Shard& shard = GetShard(prehashed);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto key_iterator = shard.map.find(prehashed);
+        if (key_iterator == shard.map.end()) {
+            return std::nullopt;
+        }
+        return key_iterator->second;
+    }
+
+    // Complexity: O(1) average case.
+    bool contains(const KeyType& key) const {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        const Shard& shard = GetShard(prehashed);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.map.contains(prehashed);
+    }
+
+    // Same as HashMap::at, but returns copy of the value.
+    // Complexity: O(1) average case.
+    ValueType at(const KeyType& key) const {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        const Shard& shard = GetShard(prehashed);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.map.at(prehashed);
+    }
+
+    // Inserts element if its key is not present yet; returns whether it was inserted.
+    // Complexity: O(1) average case.
+    bool insert(const KeyValuePair& element) {
+        PrehashedKey<KeyType> prehashed = Map::prehash(element.first, hasher_);
+        Shard& shard = GetShard(prehashed);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.map.try_emplace(prehashed, element.second).second;
+    }
+
+    // Sets value of the element with key == Key, inserting it if necessary.
+    // Complexity: O(1) average case.
+    void insert_or_assign(const KeyType& key, const ValueType& value) {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        Shard& shard = GetShard(prehashed);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.map.insert_or_assign(prehashed, value);
+    }
+
+    // Counterpart of operator[]: calls function(value) for the element with key == Key
+    // (inserting it with default value if necessary) while holding the shard lock,
+    // and returns copy of the resulting value.
+    // Complexity: O(1) average case plus running time of function.
+    template<class Function>
+    ValueType update(const KeyType& key, Function function) {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        Shard& shard = GetShard(prehashed);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        ValueType& value = shard.map[prehashed];
+        function(value);
+        return value;
+    }
+
+    // Removes element with key == Key; returns whether it existed.
+    // Complexity: O(1) average case.
+    bool erase(const KeyType& key) {
+        PrehashedKey<KeyType> prehashed = Map::prehash(key, hasher_);
+        Shard& shard = GetShard(prehashed);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        size_t old_size = shard.map.size();
+        shard.map.erase(prehashed);
+        return shard.map.size() != old_size;
+    }
+
+    // Shards are locked one by one, so under concurrent modifications the result
+    // isn't a snapshot of any single moment.
+    // Complexity: O(shard_count) guaranteed.
+    size_t size() const {
+        size_t result = 0;
+        for (size_t ind = 0; ind < shard_count(); ++ind) {
+            std::shared_lock<std::shared_mutex> lock(shards_[ind].mutex);
+            result += shards_[ind].map.size();
+        }
+        return result;
+    }
+
+    // Complexity: O(shard_count) guaranteed.
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Complexity: O(# of elements in hash map + shard_count) guaranteed.
+    void clear() {
+        for (size_t ind = 0; ind < shard_count(); ++ind) {
+            std::unique_lock<std::shared_mutex> lock(shards_[ind].mutex);
+            shards_[ind].map.clear();
+        }
+    }
+
+    // Calls function(const KeyValuePair&) for every element, holding lock of one shard at a time.
+    // Complexity: O(# of elements in hash map + shard_count) guaranteed.
+    template<class Function>
+    void for_each(Function function) const {
+        for (size_t ind = 0; ind < shard_count(); ++ind) {
+            std::shared_lock<std::shared_mutex> lock(shards_[ind].mutex);
+            for (const KeyValuePair& element : shards_[ind].map) {
+                function(element);
+            }
+        }
+    }
+
+  private:
+    // Shards are aligned to separate cache lines, so that locking one of them
+    // doesn't invalidate the lock of its neighbour.
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        Map map;
+    };
+
+  private:
+    // Complexity: O(1) guaranteed.
+    size_t GetShardIndex(const PrehashedKey<KeyType>& key) const {
+        if (shard_bits_ == 0) {
+            return 0;
+        }
+        uint64_t mixed_hash = IntegerHash<uint64_t>()(static_cast<uint64_t>(key.hash));
+        return static_cast<size_t>(mixed_hash >> (64 - shard_bits_));
+    }
+
+    // Complexity: O(1) guaranteed.
+    Shard& GetShard(const PrehashedKey<KeyType>& key) {
+        return shards_[GetShardIndex(key)];
+    }
+
+    // Complexity: O(1) guaranteed.
+    const Shard& GetShard(const PrehashedKey<KeyType>& key) const {
+        return shards_[GetShardIndex(key)];
+    }
+
+  private:
+    std::unique_ptr<Shard[]> shards_;
+    size_t shard_bits_ = 0;
+    Hash hasher_;
+};
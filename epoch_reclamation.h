@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <utility>
+#include <vector>
+
+/*
+ * Epoch-based memory reclamation for concurrent hash maps, whose readers traverse arrays
+ * that writers may replace (HashMap data_ and hash_table_ on growth or rehash, tables of
+ * LockFreeHashMap on resize).
+ * Reader pins the domain for the time of its operation (EpochDomain::Guard): it announces
+ * the current global epoch in its own slot. Writer that has detached an object from the
+ * shared structure retires it: the global epoch is incremented, and the object is tagged
+ * with the new value. Readers pinned at this or a later epoch started after the object
+ * was detached, so the object is freed as soon as no slot holds an older epoch.
+ * Pinning costs a seq_cst store to the thread's own slot and a seq_cst load of the global
+ * epoch; there is no atomic read-modify-write on the read side.
+ * Each thread gets its own index (shared by all domains) on first use; indexes of finished
+ * threads are reused, lowest first. A domain has slot_count slots (kDefaultSlotCount unless
+ * given to the constructor), used by threads with indexes below slot_count. Threads beyond
+ * that are never refused: they pin through a shared counter of overflow readers instead,
+ * which costs an atomic read-modify-write, and while any of them is pinned, no retired
+ * object is freed. So slot_count should cover the threads that use the domain regularly.
+ */
+class EpochDomain {
+  public:
+    constexpr static size_t kDefaultSlotCount = 64;
+
+    // Pins the domain for the lifetime of the guard. Nested guards of the same domain
+    // in the same thread are allowed, only the outermost one pins.
+    class Guard {
+      public:
+        // Complexity: O(1) guaranteed, if there are no concurrent retirements.
+        explicit Guard(const EpochDomain& domain) : domain_(domain) {
+            size_t index = GetThreadIndex();
+            if (index >= domain.slot_count_) {
+                // Same protocol as the announcement below: either reclaim sees the increment,
+                // or the load of the epoch sees the retirement that reclaim works for.
+                domain.overflow_readers_.fetch_add(1, std::memory_order_seq_cst);
+                domain.epoch_.load(std::memory_order_seq_cst);
+                return;
+            }
+            slot_ = &domain.slots_[index].epoch;
+            if (slot_->load(std::memory_order_relaxed) != kIdle) {
+                nested_ = true;
+                return;
+            }
+            uint64_t epoch = domain.epoch_.load(std::memory_order_acquire);
+            while (true) {
+                // Announcement must be visible before we read anything protected by it,
+                // and the epoch must be still the same after it is: otherwise a retirement
+                // might have missed the announcement. Both are seq_cst, as are the increment
+                // of the epoch and the loads of the slots in retire and reclaim.
+                slot_->store(epoch, std::memory_order_seq_cst);
+                uint64_t current_epoch = domain.epoch_.load(std::memory_order_seq_cst);
+                if (current_epoch == epoch) {
+                    break;
+                }
+                epoch = current_epoch;
+            }
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        // Complexity: O(1) guaranteed.
+        ~Guard() {
+            if (slot_ == nullptr) {
+                domain_.overflow_readers_.fetch_sub(1, std::memory_order_release);
+            } else if (!nested_) {
+                slot_->store(kIdle, std::memory_order_release);
+            }
+        }
+
+      private:
+        const EpochDomain& domain_;
+        // Own slot of the thread, nullptr for an overflow reader.
+        std::atomic<uint64_t>* slot_ = nullptr;
+        bool nested_ = false;
+    };
+
+  public:
+    // Complexity: O(slot_count) guaranteed.
+    explicit EpochDomain(const size_t slot_count = kDefaultSlotCount) :
+            slot_count_(slot_count), slots_(new Slot[slot_count]) {
+        for (size_t ind = 0; ind < slot_count_; ++ind) {
+            slots_[ind].epoch.store(kIdle, std::memory_order_relaxed);
+        }
+    }
+
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    // Complexity: O(1) guaranteed.
+    size_t slot_count() const {
+        return slot_count_;
+    }
+
+    // Takes ownership of an object that is no longer reachable for new readers;
+    // the object is destroyed (its last shared_ptr released) when no reader can access it.
+    // Complexity: O(1) amortized, plus reclaim().
+    void retire(std::shared_ptr<void> object) {
+        uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        {
+            std::lock_guard<std::mutex> lock(retired_mutex_);
+            retired_.emplace_back(epoch, std::move(object));
+        }
+        reclaim();
+    }
+
+    // Frees retired objects that no reader can access anymore.
+    // Called automatically by retire.
+    // Complexity: O(slot_count + # of retired objects) guaranteed.
+    void reclaim() {
+        std::unique_lock<std::mutex> lock(retired_mutex_, std::try_to_lock);
+        if (!lock.owns_lock() || retired_.empty()) {
+            return;
+        }
+        if (overflow_readers_.load(std::memory_order_seq_cst) > 0) {
+            return;
+        }
+        uint64_t oldest_reader = kIdle;
+        for (size_t ind = 0; ind < slot_count_; ++ind) {
+            oldest_reader = std::min(oldest_reader,
+                                     slots_[ind].epoch.load(std::memory_order_seq_cst));
+        }
+        std::vector<std::shared_ptr<void>> freed;
+        size_t kept = 0;
+        for (size_t ind = 0; ind < retired_.size(); ++ind) {
+            if (retired_[ind].first > oldest_reader) {
+                retired_[kept++] = std::move(retired_[ind]);
+            } else {
+                freed.push_back(std::move(retired_[ind].second));
+            }
+        }
+        retired_.resize(kept);
+        // Objects are destroyed after the lock is released.
+        lock.unlock();
+    }
+
+    // Number of retired objects that are not freed yet.
+    // Complexity: O(1) guaranteed.
+    size_t retired_count() const {
+        std::lock_guard<std::mutex> lock(retired_mutex_);
+        return retired_.size();
+    }
+
+  private:
+    constexpr static uint64_t kIdle = UINT64_MAX;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch;
+    };
+
+    // Gives every live thread its own index, the lowest one not used by another live
+    // thread, so that threads get slots of domains whenever possible.
+    class ThreadRegistry {
+      public:
+        static size_t Acquire() {
+            std::lock_guard<std::mutex> lock(Mutex());
+            FreeIndexes& free_indexes = GetFreeIndexes();
+            if (!free_indexes.empty()) {
+                size_t index = free_indexes.top();
+                free_indexes.pop();
+                return index;
+            }
+            return NextIndex()++;
+        }
+
+        static void Release(size_t index) {
+            std::lock_guard<std::mutex> lock(Mutex());
+            GetFreeIndexes().push(index);
+        }
+
+      private:
+        using FreeIndexes = std::priority_queue<size_t, std::vector<size_t>,
+                                                std::greater<size_t>>;
+
+        static std::mutex& Mutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static FreeIndexes& GetFreeIndexes() {
+            static FreeIndexes free_indexes;
+            return free_indexes;
+        }
+
+        static size_t& NextIndex() {
+            static size_t next_index = 0;
+            return next_index;
+        }
+    };
+
+    struct ThreadIndex {
+        ThreadIndex() : index(ThreadRegistry::Acquire()) {}
+        ~ThreadIndex() {
+            ThreadRegistry::Release(index);
+        }
+
+        size_t index;
+    };
+
+  private:
+    // Complexity: O(1) guaranteed (except for the first call in a thread).
+    static size_t GetThreadIndex() {
+        thread_local ThreadIndex thread_index;
+        return thread_index.index;
+    }
+
+  private:
+    std::atomic<uint64_t> epoch_{0};
+    const size_t slot_count_;
+    const std::unique_ptr<Slot[]> slots_;
+    // # of pinned readers without a slot.
+    mutable std::atomic<size_t> overflow_readers_{0};
+    mutable std::mutex retired_mutex_;
+    // Retired objects together with epoch right after they were detached.
+    std::vector<std::pair<uint64_t, std::shared_ptr<void>>> retired_;
+};
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <type_traits>
+
+#if __cplusplus >= 201703L
+#include <string>
+#include <string_view>
+#endif
+
+#if (defined(__AVX512F__) && defined(__AVX512DQ__)) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Source of per-instance hash seeds: entropy of std::random_device is drawn once per process
+ * and mixed with a global counter, so seeds are distinct and unpredictable from outside,
+ * without a system call per seed.
+ */
+class RandomSeed {
+  public:
+    // Complexity: O(1) guaranteed (except for the first call).
+    static uint64_t Next() {
+        static const uint64_t base = Entropy();
+        static std::atomic<uint64_t> counter{0};
+        uint64_t value = base + counter.fetch_add(1, std::memory_order_relaxed) *
+                                0x9e3779b97f4a7c15ULL;
+        value ^= value >> 31;
+        value *= 0xbf58476d1ce4e5b9ULL;
+        value ^= value >> 29;
+        return value;
+    }
+
+  private:
+    static uint64_t Entropy() {
+        std::random_device device;
+        return (static_cast<uint64_t>(device()) << 32) ^ device();
+    }
+};
+
+/*
+ * Hash function for integral keys (up to 64 bits) based on multiply-xorshift mixing.
+ * Unlike std::hash, which is identity for integers in libstdc++, every bit of the key
+ * affects every bit of the result, so keys with regular structure (sequential ids,
+ * multiples of a power of two) spread evenly over any number of buckets.
+ * Besides regular operator() it provides HashBatch, that hashes array of keys with
+ * AVX-512 (8 keys per instruction) or AVX2 (4 keys per instruction) when the target
+ * supports them, with scalar fallback otherwise. All paths return identical results.
+ * HashMap detects HashBatch and uses it in batched operations (find_batch, range insert).
+ * Key is xored with seed before mixing; default seed 0 keeps hashes stable between runs.
+ * WithSeed lets HashMap replace the seed when it detects a flood of colliding keys.
+ */
+template<class KeyType>
+class IntegerHash {
+    static_assert(std::is_integral<KeyType>::value && sizeof(KeyType) <= sizeof(uint64_t),
+                  "IntegerHash supports only integral keys up to 64 bits.");
+
+  public:
+    constexpr static uint64_t kMultiplier = 0xd6e8feb86659fd93ULL;
+
+    // Complexity: O(1) guaranteed.
+    explicit IntegerHash(const uint64_t seed_ = 0) : seed_(seed_) {}
+
+    // Complexity: O(1) guaranteed.
+    size_t operator()(const KeyType key) const {
+        return static_cast<size_t>(Mix(static_cast<uint64_t>(key) ^ seed_));
+    }
+
+    // Writes hashes of keys[0..count) to hashes[0..count).
+    // Complexity: O(count) guaranteed.
+    void HashBatch(const KeyType* keys, size_t count, size_t* hashes) const {
+        size_t ind = HashBatchVectorized(keys, count, hashes, seed_);
+        for (; ind < count; ++ind) {
+            hashes[ind] = (*this)(keys[ind]);
+        }
+    }
+
+    // Complexity: O(1) guaranteed.
+    IntegerHash WithSeed(const uint64_t seed) const {
+        return IntegerHash(seed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    uint64_t seed() const {
+        return seed_;
+    }
+
+  private:
+    // Scalar version of the mixing function, every vectorized path below repeats it step by step.
+    // Complexity: O(1) guaranteed.
+    static uint64_t Mix(uint64_t value) {
+        value ^= value >> 32;
+        value *= kMultiplier;
+        value ^= value >> 32;
+        value *= kMultiplier;
+        value ^= value >> 32;
+        return value;
+    }
+
+    // Hashes the longest prefix of keys that fits into whole vectors, returns its length.
+    // Complexity: O(count) guaranteed.
+    static size_t HashBatchVectorized(const KeyType* keys, size_t count, size_t* hashes,
+                                      const uint64_t seed) {
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+        constexpr size_t kWidth = 8;
+        const __m512i multiplier = _mm512_set1_epi64(static_cast<long long>(kMultiplier));
+        const __m512i seed_vector = _mm512_set1_epi64(static_cast<long long>(seed));
+        size_t ind = 0;
+        for (; ind + kWidth <= count && sizeof(size_t) == sizeof(uint64_t); ind += kWidth) {
+            __m512i value = _mm512_xor_si512(Load512(keys + ind), seed_vector);
+            value = _mm512_xor_si512(value, ShiftRight512(value));
+            value = _mm512_mullo_epi64(value, multiplier);
+            value = _mm512_xor_si512(value, ShiftRight512(value));
+            value = _mm512_mullo_epi64(value, multiplier);
+            value = _mm512_xor_si512(value, ShiftRight512(value));
+            _mm512_storeu_si512(reinterpret_cast<void*>(hashes + ind), value);
+        }
+        return ind;
+#elif defined(__AVX2__)
+        constexpr size_t kWidth = 4;
+        const __m256i seed_vector = _mm256_set1_epi64x(static_cast<long long>(seed));
+        size_t ind = 0;
+        for (; ind + kWidth <= count && sizeof(size_t) == sizeof(uint64_t); ind += kWidth) {
+            __m256i value = _mm256_xor_si256(Load256(keys + ind), seed_vector);
+            value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 32));
+            value = Multiply256(value);
+            value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 32));
+            value = Multiply256(value);
+            value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 32));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes + ind), value);
+        }
+        return ind;
+#else
+        (void)keys;
+        (void)count;
+        (void)hashes;
+        (void)seed;
+        return 0;
+#endif
+    }
+
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    // Loads 8 keys widened to 64 bits the same way static_cast<uint64_t> does.
+    static __m512i Load512(const KeyType* keys) {
+        if (sizeof(KeyType) == sizeof(uint64_t)) {
+            return _mm512_loadu_si512(reinterpret_cast<const void*>(keys));
+        }
+        if (sizeof(KeyType) == sizeof(uint32_t)) {
+            __m256i narrow = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+            return std::is_signed<KeyType>::value
+                    ? _mm512_maskz_cvtepi32_epi64(kAllLanes, narrow)
+                    : _mm512_maskz_cvtepu32_epi64(kAllLanes, narrow);
+        }
+        return LoadScalar<__m512i>(keys, 8);
+    }
+
+    // Unmasked AVX-512 intrinsics pass _mm512_undefined_epi32() as the merge source, which
+    // GCC 12 reports with -Wmaybe-uninitialized; zero-masking with all lanes set compiles
+    // to the same instruction without it.
+    constexpr static __mmask8 kAllLanes = 0xff;
+
+    static __m512i ShiftRight512(__m512i value) {
+        return _mm512_maskz_srli_epi64(kAllLanes, value, 32);
+    }
+#elif defined(__AVX2__)
+    // Loads 4 keys widened to 64 bits the same way static_cast<uint64_t> does.
+    static __m256i Load256(const KeyType* keys) {
+        if (sizeof(KeyType) == sizeof(uint64_t)) {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+        }
+        if (sizeof(KeyType) == sizeof(uint32_t)) {
+            __m128i narrow = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+            return std::is_signed<KeyType>::value ? _mm256_cvtepi32_epi64(narrow)
+                                                  : _mm256_cvtepu32_epi64(narrow);
+        }
+        return LoadScalar<__m256i>(keys, 4);
+    }
+
+    // AVX2 has no 64-bit multiplication, so we assemble low 64 bits of the product
+    // from three 32x32->64 multiplications.
+    static __m256i Multiply256(__m256i value) {
+        const __m256i multiplier = _mm256_set1_epi64x(static_cast<long long>(kMultiplier));
+        const __m256i multiplier_high = _mm256_set1_epi64x(
+                static_cast<long long>(kMultiplier >> 32));
+        __m256i low = _mm256_mul_epu32(value, multiplier);
+        __m256i cross = _mm256_add_epi64(
+                _mm256_mul_epu32(_mm256_srli_epi64(value, 32), multiplier),
+                _mm256_mul_epu32(value, multiplier_high));
+        return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+    }
+#endif
+
+#if (defined(__AVX512F__) && defined(__AVX512DQ__)) || defined(__AVX2__)
+    // Widening of 8- and 16-bit keys, which are too rare to deserve dedicated code.
+    template<class Vector>
+    static Vector LoadScalar(const KeyType* keys, size_t width) {
+        alignas(sizeof(Vector)) uint64_t widened[sizeof(Vector) / sizeof(uint64_t)];
+        for (size_t ind = 0; ind < width; ++ind) {
+            widened[ind] = static_cast<uint64_t>(keys[ind]);
+        }
+        Vector result;
+        std::memcpy(&result, widened, sizeof(Vector));
+        return result;
+    }
+#endif
+
+  private:
+    uint64_t seed_;
+};
+
+#if __cplusplus >= 201703L
+/*
+ * Transparent hash function for std::string keys: std::string, std::string_view and
+ * const char* give equal hashes for equal strings, so HashMap<std::string, ValueType,
+ * StringHash, std::equal_to<>> can be searched by any of them without constructing
+ * a temporary std::string.
+ */
+struct StringHash {
+    using is_transparent = void;
+
+    // Complexity: O(|key|) guaranteed.
+    size_t operator()(const std::string_view key) const {
+        return std::hash<std::string_view>()(key);
+    }
+};
+#endif
+
+/*
+ * Fast 64-bit hash of byte strings in the style of wyhash: input is consumed 16 or 48 bytes
+ * at a time, and every step is a 64x64->128 bit multiplication of two input words (each
+ * mixed with a constant or the running state), folded by xor of the halves of the product.
+ * The halves are xored with the operands first (the "condom" variant of wyhash): the
+ * constants are public, so input can zero an operand, and a plain product would then wipe
+ * the seed and let colliding inputs collide under every seed.
+ * Strings up to 16 bytes are read with at most four possibly overlapping loads, without
+ * any loop. Throughput is bounded by the multiplier, several times faster than std::hash
+ * (byte-wise murmur in libstdc++) on long strings.
+ */
+class WyHash {
+  public:
+    constexpr static uint64_t kSecret0 = 0xa0761d6478bd642fULL;
+    constexpr static uint64_t kSecret1 = 0xe7037ed1a0b428dbULL;
+    constexpr static uint64_t kSecret2 = 0x8ebc6af09c88c6e3ULL;
+    constexpr static uint64_t kSecret3 = 0x589965cc75374cc3ULL;
+
+    // Complexity: O(size) guaranteed.
+    static uint64_t Hash(const void* data, const size_t size, uint64_t seed) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        seed ^= Mum(seed ^ kSecret0, kSecret1);
+        uint64_t first;
+        uint64_t second;
+        if (size <= 16) {
+            if (size >= 4) {
+                size_t shift = (size >> 3) << 2;
+                first = (Read32(bytes) << 32) | Read32(bytes + shift);
+                second = (Read32(bytes + size - 4) << 32) | Read32(bytes + size - 4 - shift);
+            } else if (size > 0) {
+                first = (static_cast<uint64_t>(bytes[0]) << 16) |
+                        (static_cast<uint64_t>(bytes[size >> 1]) << 8) | bytes[size - 1];
+                second = 0;
+            } else {
+                first = second = 0;
+            }
+        } else {
+            size_t left = size;
+            if (left > 48) {
+                uint64_t seed1 = seed;
+                uint64_t seed2 = seed;
+                do {
+                    seed = Mum(Read64(bytes) ^ kSecret1, Read64(bytes + 8) ^ seed);
+                    seed1 = Mum(Read64(bytes + 16) ^ kSecret2, Read64(bytes + 24) ^ seed1);
+                    seed2 = Mum(Read64(bytes + 32) ^ kSecret3, Read64(bytes + 40) ^ seed2);
+                    bytes += 48;
+                    left -= 48;
+                } while (left > 48);
+                seed ^= seed1 ^ seed2;
+            }
+            while (left > 16) {
+                seed = Mum(Read64(bytes) ^ kSecret1, Read64(bytes + 8) ^ seed);
+                bytes += 16;
+                left -= 16;
+            }
+            first = Read64(bytes + left - 16);
+            second = Read64(bytes + left - 8);
+        }
+        first ^= kSecret1;
+        second ^= seed;
+        Multiply(first, second);
+        return Mum(first ^ kSecret0 ^ size, second ^ kSecret1);
+    }
+
+  private:
+    // Xors first and second with low and high halves of their 128-bit product, so a zero
+    // operand keeps the other one instead of zeroing both.
+    // Complexity: O(1) guaranteed.
+    static void Multiply(uint64_t& first, uint64_t& second) {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 product = static_cast<unsigned __int128>(first) * second;
+        first ^= static_cast<uint64_t>(product);
+        second ^= static_cast<uint64_t>(product >> 64);
+#else
+        uint64_t first_high = first >> 32;
+        uint64_t first_low = static_cast<uint32_t>(first);
+        uint64_t second_high = second >> 32;
+        uint64_t second_low = static_cast<uint32_t>(second);
+        uint64_t low_low = first_low * second_low;
+        uint64_t low_high = first_low * second_high;
+        uint64_t high_low = first_high * second_low;
+        uint64_t high_high = first_high * second_high;
+        uint64_t middle = (low_low >> 32) + static_cast<uint32_t>(low_high) +
+                          static_cast<uint32_t>(high_low);
+        first ^= (middle << 32) | static_cast<uint32_t>(low_low);
+        second ^= high_high + (low_high >> 32) + (high_low >> 32) + (middle >> 32);
+#endif
+    }
+
+    // Complexity: O(1) guaranteed.
+    static uint64_t Mum(uint64_t first, uint64_t second) {
+        Multiply(first, second);
+        return first ^ second;
+    }
+
+    // Unaligned little-endian loads (byte order doesn't matter for hashing,
+    // as long as it is the same everywhere the hash is computed).
+    // Complexity: O(1) guaranteed.
+    static uint64_t Read64(const unsigned char* bytes) {
+        uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+
+    // Complexity: O(1) guaranteed.
+    static uint64_t Read32(const unsigned char* bytes) {
+        uint32_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+};
+
+/*
+ * Default hash family of FastHashMap:
+ * - integral keys are hashed with IntegerHash (full avalanche, batched hashing);
+ * - std::string and std::string_view keys are hashed with WyHash (the std::string version
+ *   is transparent, so it accepts std::string_view and const char* as well);
+ * - other trivially copyable keys without padding bits (e.g. structs of integers) are
+ *   hashed as byte strings with WyHash.
+ * Every default constructed instance gets its own random seed (RandomSeed), so hash values
+ * and collisions can't be predicted from outside; equal keys have equal hashes only under
+ * the same seed, i.e. hash maps that share precomputed hashes must copy the hash function.
+ * Explicit seed gives reproducible hashes. WithSeed lets HashMap reseed the hash function
+ * when it detects a flood of colliding keys.
+ */
+template<class KeyType, class Enable = void>
+class FastHash {
+    static_assert(std::is_trivially_copyable<KeyType>::value,
+                  "FastHash supports integral, string and trivially copyable keys.");
+#if __cplusplus >= 201703L
+    static_assert(std::has_unique_object_representations<KeyType>::value,
+                  "FastHash can't hash keys with padding or floating point members as bytes.");
+#endif
+
+  public:
+    // Complexity: O(1) guaranteed.
+    FastHash() : seed_(RandomSeed::Next()) {}
+
+    // Complexity: O(1) guaranteed.
+    explicit FastHash(const uint64_t seed_) : seed_(seed_) {}
+
+    // Complexity: O(sizeof(KeyType)) guaranteed.
+    size_t operator()(const KeyType& key) const {
+        return static_cast<size_t>(WyHash::Hash(&key, sizeof(key), seed_));
+    }
+
+    // Complexity: O(1) guaranteed.
+    FastHash WithSeed(const uint64_t seed) const {
+        return FastHash(seed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    uint64_t seed() const {
+        return seed_;
+    }
+
+  private:
+    uint64_t seed_;
+};
+
+template<class KeyType>
+class FastHash<KeyType, typename std::enable_if<std::is_integral<KeyType>::value>::type> :
+        public IntegerHash<KeyType> {
+  public:
+    // Complexity: O(1) guaranteed.
+    FastHash() : IntegerHash<KeyType>(RandomSeed::Next()) {}
+
+    // Complexity: O(1) guaranteed.
+    explicit FastHash(const uint64_t seed_) : IntegerHash<KeyType>(seed_) {}
+
+    // Complexity: O(1) guaranteed.
+    FastHash WithSeed(const uint64_t seed) const {
+        return FastHash(seed);
+    }
+};
+
+#if __cplusplus >= 201703L
+template<>
+class FastHash<std::string_view> {
+  public:
+    using is_transparent = void;
+
+    // Complexity: O(1) guaranteed.
+    FastHash() : seed_(RandomSeed::Next()) {}
+
+    // Complexity: O(1) guaranteed.
+    explicit FastHash(const uint64_t seed_) : seed_(seed_) {}
+
+    // Complexity: O(|key|) guaranteed.
+    size_t operator()(const std::string_view key) const {
+        return static_cast<size_t>(WyHash::Hash(key.data(), key.size(), seed_));
+    }
+
+    // Complexity: O(1) guaranteed.
+    FastHash WithSeed(const uint64_t seed) const {
+        return FastHash(seed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    uint64_t seed() const {
+        return seed_;
+    }
+
+  private:
+    uint64_t seed_;
+};
+
+template<>
+class FastHash<std::string> : public FastHash<std::string_view> {
+  public:
+    // Complexity: O(1) guaranteed.
+    FastHash() = default;
+
+    // Complexity: O(1) guaranteed.
+    explicit FastHash(const uint64_t seed_) : FastHash<std::string_view>(seed_) {}
+
+    // Complexity: O(1) guaranteed.
+    FastHash WithSeed(const uint64_t seed) const {
+        return FastHash(seed);
+    }
+};
+#endif
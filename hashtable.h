@@ -1,8 +1,203 @@
+#pragma once
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "hash.h"
+#include "hashtable_counters.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HASHMAP_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define HASHMAP_PREFETCH(address) ((void)(address))
+#endif
+
+/*
+ * Key together with its precomputed hash (see HashMap::prehash). Hash is computed once
+ * and reused by lookups of the same key in several hash maps with the same hash function.
+ * Refers to the key, which must outlive it. Hash is tagged with the seed of the hash
+ * function that computed it (0 for hash functions without seed()): a hash map whose hash
+ * function has another seed, e.g. after a reseed (see HashMap::reseed_count) or another
+ * default constructed FastHash, recomputes the hash instead of using it.
+ */
+template<class KeyType>
+struct PrehashedKey {
+    const KeyType& key;
+    size_t hash;
+    uint64_t seed;
+};
+
+/*
+ * Snapshot of the shape of a hash map and of its rehash history (see HashMap::stats).
+ * Comparison counts are the average # of key equality checks a lookup makes in the current
+ * hash table: of all elements for successful lookups, and of a key whose hash differs from
+ * hashes of all elements (a uniformly random bucket) for failed lookups.
+ */
+struct HashMapStats {
+    size_t element_count = 0;
+    size_t bucket_count = 0;
+    size_t empty_bucket_count = 0;
+    // chain_length_histogram[length] is # of buckets holding length elements.
+    std::vector<size_t> chain_length_histogram;
+    size_t max_chain_length = 0;
+    // Over non-empty buckets.
+    double mean_chain_length = 0;
+    double load_factor = 0;
+    double successful_lookup_comparisons = 0;
+    double failed_lookup_comparisons = 0;
+    // Buckets with a sorted index (see HashMap::kTreeifyThreshold).
+    size_t long_bucket_count = 0;
+    size_t rehash_count = 0;
+    // Time the owning thread has spent rebuilding hash table, including installation
+    // of background rehashes and rebuilds after reseeds.
+    std::chrono::nanoseconds rehash_time{0};
+    size_t reseed_count = 0;
+};
+
+/*
+ * Rehash of a hash map, passed to its rehash callback (see HashMap::set_rehash_callback).
+ */
+struct HashMapRehashEvent {
+    enum class Trigger {
+        // Insertion has exceeded the maximal load.
+        kGrow,
+        // Erasure has gone below the minimal load.
+        kShrink,
+        kClear,
+        // HashMap::rehash.
+        kExplicit,
+        // Hash function has been reseeded after a chain became too long.
+        kReseed
+    };
+
+    Trigger trigger;
+    size_t old_bucket_count;
+    size_t new_bucket_count;
+    size_t element_count;
+    // Time spent by the thread that caused the rehash. For a background rehash it is
+    // the time to install the hash table built by the background thread.
+    std::chrono::nanoseconds duration;
+    bool background;
+
+    static const char* TriggerName(const Trigger trigger) {
+        switch (trigger) {
+            case Trigger::kGrow:
+                return "grow";
+            case Trigger::kShrink:
+                return "shrink";
+            case Trigger::kClear:
+                return "clear";
+            case Trigger::kExplicit:
+                return "explicit";
+            case Trigger::kReseed:
+                return "reseed";
+        }
+        return "unknown";
+    }
+};
+
+/*
+ * Bytes held by the structures of a hash map (see HashMap::memory_usage). Memory owned
+ * by keys and values themselves (e.g. characters of long strings) is not included.
+ * Allocator overhead is an estimate for a malloc that prefixes every block with
+ * a kAllocatorHeaderBytes header and rounds it up to kAllocatorAlignment, with blocks
+ * of at least kMinAllocationBytes (glibc on 64-bit platforms).
+ */
+struct HashMapMemoryUsage {
+    constexpr static size_t kAllocatorHeaderBytes = sizeof(size_t);
+    constexpr static size_t kAllocatorAlignment = 2 * sizeof(size_t);
+    constexpr static size_t kMinAllocationBytes = 4 * sizeof(size_t);
+
+    // sizeof of the hash map object itself.
+    size_t object_bytes = 0;
+    // Elements in data_: constructed ones and the whole capacity.
+    size_t data_used_bytes = 0;
+    size_t data_allocated_bytes = 0;
+    // Array of buckets (hash_table_).
+    size_t table_bytes = 0;
+    // Heap blocks of individual buckets: their bytes and number.
+    size_t bucket_bytes = 0;
+    size_t bucket_allocations = 0;
+    // Sorted indexes of long buckets.
+    size_t long_bucket_bytes = 0;
+    size_t allocator_overhead_bytes = 0;
+    // All of the above except data_used_bytes (included in data_allocated_bytes).
+    size_t total_bytes = 0;
+
+    // Estimated bytes the allocator spends on a heap block of the given size beyond it.
+    static size_t EstimateAllocatorOverhead(const size_t bytes) {
+        if (bytes == 0) {
+            return 0;
+        }
+        size_t block = (bytes + kAllocatorHeaderBytes + kAllocatorAlignment - 1) /
+                       kAllocatorAlignment * kAllocatorAlignment;
+        return std::max(block, static_cast<size_t>(kMinAllocationBytes)) - bytes;
+    }
+};
+
+/*
+ * Holder of a function object. Empty function objects (e.g. std::hash, std::equal_to)
+ * are stored as a base class, so they take no space (empty base optimization).
+ * Index distinguishes holders of two functions of the same type.
+ * std::is_final is C++14, its intrinsic __is_final is available to C++11 code as well.
+ */
+template<class Function, size_t Index,
+         bool = std::is_empty<Function>::value && !__is_final(Function)>
+class HashMapFunctionHolder : private Function {
+  public:
+    explicit HashMapFunctionHolder(const Function& function) : Function(function) {}
+
+    const Function& Get() const {
+        return *this;
+    }
+};
+
+template<class Function, size_t Index>
+class HashMapFunctionHolder<Function, Index, false> {
+  public:
+    explicit HashMapFunctionHolder(const Function& function) : function_(function) {}
+
+    const Function& Get() const {
+        return function_;
+    }
+
+  private:
+    Function function_;
+};
+
+/*
+ * Hash function and key equality of a hash map (HashMap, StripedHashMap), both stored
+ * with HashMapFunctionHolder.
+ */
+template<class Hash, class KeyEqual>
+class HashMapFunctions : private HashMapFunctionHolder<Hash, 0>,
+                         private HashMapFunctionHolder<KeyEqual, 1> {
+  public:
+    HashMapFunctions(const Hash& hasher, const KeyEqual& key_equal) :
+            HashMapFunctionHolder<Hash, 0>(hasher), HashMapFunctionHolder<KeyEqual, 1>(key_equal) {}
+
+    const Hash& hasher() const {
+        return HashMapFunctionHolder<Hash, 0>::Get();
+    }
+
+    const KeyEqual& key_equal() const {
+        return HashMapFunctionHolder<KeyEqual, 1>::Get();
+    }
+};
+
 /*
  * Implementation of hash map using seperate chaining with dynamic arrays (vectors) and linear probing.
  * Iteration over elements of hash map is linear as we store all elements in a separate array
@@ -15,12 +210,37 @@
  * otherwise we store kMinLoad buckets (kMinLoad > 0).
  * To achieve this we resize our hash table each time this invariant breaks.
  */
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType>>
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+         class KeyEqual = std::equal_to<KeyType>>
 class HashMap {
+    template<class, class, class, class> friend class SeqlockHashMap;
+
   public:
     constexpr static size_t kMinLoad = 3;
     constexpr static size_t kMinLoadFactor = 3;
     constexpr static size_t kMaxLoadFactor = 2;
+    // Number of lookups kept in flight by find_batch.
+    constexpr static size_t kLookupGroupSize = 16;
+    // Minimal number of elements per thread in parallel construction,
+    // smaller inputs are processed by fewer threads.
+    constexpr static size_t kMinElementsPerThread = 1 << 14;
+    // Number of bucket ranges per thread in parallel construction.
+    constexpr static size_t kPartitionsPerThread = 8;
+    // Minimal # of elements for which background rehash is used, smaller hash tables
+    // are rebuilt faster than a thread starts.
+    constexpr static size_t kMinBackgroundRehashSize = 1 << 15;
+    // Number of elements whose keys background rehash hashes at once; an erasure that has
+    // to move an element the background thread hasn't hashed yet hashes its chunk first.
+    constexpr static size_t kBackgroundRehashChunk = 1 << 12;
+    // Insertion into a bucket that already holds kMaxChainLength elements reseeds hash
+    // function (if it supports WithSeed and seed) and rebuilds hash table. Under the resize
+    // policy chains this long are practically impossible unless keys were crafted to collide.
+    constexpr static size_t kMaxChainLength = 32;
+    // Buckets longer than kTreeifyThreshold get a sorted index (see LongBucket), so lookups
+    // in them take O(log(bucket length)) steps even for a hash function with poor
+    // distribution; the index is dropped once the bucket shrinks to kUntreeifyThreshold.
+    constexpr static size_t kTreeifyThreshold = 16;
+    constexpr static size_t kUntreeifyThreshold = 8;
 
     using KeyValuePair = typename std::pair<KeyType, ValueType>;
     using KeyValuePairConstKey = typename std::pair<const KeyType, ValueType>;
@@ -83,7 +303,35 @@ class HashMap {
 
     // Complexity: O(1) average case.
     iterator find(const KeyType& key) {
-        return FindByTableBucket(GetTableBucket(key), key);
+        return FindByHash(GetHasher()(key), key);
+    }
+
+    // Lookup by a key of another type (e.g. std::string_view or const char* for std::string
+    // keys) without converting it to KeyType. Enabled if both hash function and key equality
+    // declare is_transparent (e.g. StringHash and std::equal_to<>); hash function must give
+    // equal hashes for equal keys of both types.
+    // Complexity: O(1) average case.
+    template<class Key, class HashFunction = Hash, class Equal = KeyEqual,
+             class = typename HashFunction::is_transparent,
+             class = typename Equal::is_transparent>
+    iterator find(const Key& key) {
+        return FindByHash(GetHasher()(key), key);
+    }
+
+    // Finds every key of the given array; i-th returned iterator corresponds to keys[i]
+    // (end() if there is no such key).
+    // Up to kLookupGroupSize lookups are interleaved: each of them issues a prefetch for the
+    // next hash table bucket or data_ slot it needs and yields to the next lookup, so cache
+    // misses of different lookups (and chains of different lengths) overlap.
+    // Complexity: O(# of keys) average case.
+    std::vector<iterator> find_batch(const std::vector<KeyType>& keys) {
+        std::vector<size_t> positions = FindBatchPositions(keys);
+        std::vector<iterator> result;
+        result.reserve(positions.size());
+        for (size_t position : positions) {
+            result.push_back(iterator(data_.begin() + position));
+        }
+        return result;
     }
 
     // Code bellow is practically the same as code for regular iterator.
@@ -139,36 +387,307 @@ class HashMap {
 
     // Complexity: O(1) average case.
     const_iterator find(const KeyType& key) const {
-        return FindByTableBucket(GetTableBucket(key), key);
+        return FindByHash(GetHasher()(key), key);
+    }
+
+    // Complexity: O(1) average case.
+    template<class Key, class HashFunction = Hash, class Equal = KeyEqual,
+             class = typename HashFunction::is_transparent,
+             class = typename Equal::is_transparent>
+    const_iterator find(const Key& key) const {
+        return FindByHash(GetHasher()(key), key);
+    }
+
+    // Complexity: O(1) average case.
+    bool contains(const KeyType& key) const {
+        return find(key) != end();
+    }
+
+    // Returns key together with its hash, which can be passed instead of the key to lookups
+    // in this or any other hash map of the same type. The hash is reused only while hash
+    // function of the map has the seed it was computed with (copy hash_function() to share
+    // hashes between FastHashMaps); otherwise it is recomputed.
+    // Complexity: O(1) guaranteed (assuming hash computation is O(1)).
+    PrehashedKey<KeyType> prehash(const KeyType& key) const {
+        return {key, GetHasher()(key), GetHashSeed(GetHasher(), 0)};
+    }
+
+    // Same as prehash, with the given copy of hash function, e.g. the one a wrapper uses to
+    // choose between several hash maps (see ConcurrentHashMap) before looking the key up
+    // in one of them.
+    // Complexity: O(1) guaranteed (assuming hash computation is O(1)).
+    static PrehashedKey<KeyType> prehash(const KeyType& key, const Hash& hasher) {
+        return {key, hasher(key), GetHashSeed(hasher, 0)};
+    }
+
+    // Lookups with precomputed hash of the key. The hash is used if it was computed with
+    // the current seed of hash function (see PrehashedKey), and recomputed otherwise.
+    // Complexity: O(1) average case.
+    iterator find(const PrehashedKey<KeyType>& key) {
+        return FindByHash(GetPrehash(key), key.key);
+    }
+
+    // Complexity: O(1) average case.
+    const_iterator find(const PrehashedKey<KeyType>& key) const {
+        return FindByHash(GetPrehash(key), key.key);
+    }
+
+    // Complexity: O(1) average case.
+    bool contains(const PrehashedKey<KeyType>& key) const {
+        return find(key) != end();
+    }
+
+    // Complexity: O(1) average case.
+    template<class Key, class HashFunction = Hash, class Equal = KeyEqual,
+             class = typename HashFunction::is_transparent,
+             class = typename Equal::is_transparent>
+    bool contains(const Key& key) const {
+        return find(key) != end();
+    }
+
+    // Same as find_batch for regular iterators.
+    // Complexity: O(# of keys) average case.
+    std::vector<const_iterator> find_batch(const std::vector<KeyType>& keys) const {
+        std::vector<size_t> positions = FindBatchPositions(keys);
+        std::vector<const_iterator> result;
+        result.reserve(positions.size());
+        for (size_t position : positions) {
+            result.push_back(const_iterator(data_.cbegin() + position));
+        }
+        return result;
     }
 
     // Complexity: O(1) guaranteed.
-    HashMap(const Hash& hasher_ = Hash()) : hasher_(hasher_) {
+    HashMap(const Hash& hasher_ = Hash(), const KeyEqual& key_equal_ = KeyEqual()) :
+            functions_(hasher_, key_equal_) {
         RehashIfNecessary();
     }
 
     // Complexity: O(end - begin) guaranteed, where end - begin = # of elements within range.
     template<class Iter>
-    HashMap(Iter begin, Iter end, const Hash& hasher_ = Hash()): hasher_(hasher_) {
+    HashMap(Iter begin, Iter end, const Hash& hasher_ = Hash(),
+            const KeyEqual& key_equal_ = KeyEqual()) :
+            functions_(hasher_, key_equal_) {
         for (Iter cur = begin; cur != end; ++cur) {
             data_.push_back(*cur);
         }
         RehashIfNecessary();
     }
 
+    // Builds hash map from the range using num_threads threads, for equal keys only the
+    // first element is kept (same as inserting elements one by one).
+    // Requires random access iterators and default constructible keys and values.
+    // Algorithm:
+    // 1) Copy elements to data_ in parallel and compute their buckets in parallel;
+    //    buckets are split into num_threads * kPartitionsPerThread contiguous ranges,
+    //    each thread counts its elements per range.
+    // 2) Prefix sums of the counts give every thread its own output positions, so elements
+    //    are scattered by bucket range in parallel, preserving their original order.
+    // 3) Bucket ranges are distributed between threads, each thread fills its buckets,
+    //    dropping elements whose key is already in the bucket.
+    // 4) If there were duplicates, data_ is compacted and bucket contents are renumbered.
+    // Complexity: O((end - begin) / num_threads) average case per thread.
+    template<class Iter>
+    HashMap(Iter begin, Iter end, size_t num_threads, const Hash& hasher_ = Hash(),
+            const KeyEqual& key_equal_ = KeyEqual()) :
+            functions_(hasher_, key_equal_) {
+        size_t count = end - begin;
+        data_.resize(count);
+        num_threads = GetBuildThreads(num_threads, count);
+        ParallelFor(num_threads, count, [&](size_t, size_t from, size_t to) {
+            for (size_t ind = from; ind < to; ++ind) {
+                data_[ind] = begin[ind];
+            }
+        });
+        BuildTableParallel(std::max(count, static_cast<size_t>(kMinLoad)), num_threads, true);
+        RebuildLongBuckets();
+        RehashIfNecessary();
+    }
+
+    // Copy of hash map doesn't copy background rehash in progress (see PendingRehashHolder).
+    HashMap(const HashMap& other) = default;
+    HashMap(HashMap&& other) = default;
+    HashMap& operator=(const HashMap& other) = default;
+    HashMap& operator=(HashMap&& other) = default;
+
+    // Waits for background rehash in progress, which reads keys from data_.
+    ~HashMap() {
+        pending_rehash_.Reset();
+    }
+
     // Complexity: O(# of elements in initializer_list) guaranteed.
     HashMap(const std::initializer_list<KeyValuePair>& init_list,
-            const Hash& hasher_ = Hash()) :
-            hasher_(hasher_) {
+            const Hash& hasher_ = Hash(), const KeyEqual& key_equal_ = KeyEqual()) :
+            functions_(hasher_, key_equal_) {
         for (const KeyValuePair& element : init_list) {
             data_.push_back(element);
         }
         RehashIfNecessary();
     }
 
+    // Sets number of threads used to rebuild hash table when it is resized (1 by default).
+    // Rehash of a hash map with less than 2 * kMinElementsPerThread elements is always
+    // performed by the calling thread; otherwise every thread gets at least
+    // kMinElementsPerThread elements.
+    // Complexity: O(1) guaranteed.
+    void set_rehash_threads(const size_t num_threads) {
+        rehash_threads_ = std::max<size_t>(1, num_threads);
+    }
+
+    // Complexity: O(1) guaranteed.
+    size_t rehash_threads() const {
+        return rehash_threads_;
+    }
+
+    // Enables or disables background rehash (disabled by default).
+    // When enabled, growth of a hash map with at least kMinBackgroundRehashSize elements
+    // doesn't rebuild hash table in place: a background thread builds new hash table for
+    // the current elements, while operations continue to use (and update) the old one.
+    // Insertions and erasures made meanwhile are logged, and the background thread
+    // replays them on the new table. Mutating operations install the new table once the
+    // background thread has caught up with the log, by swapping it with the old one, which
+    // the background thread then frees. So the mutating thread never waits for the whole
+    // rehash; its extra costs are:
+    // - logging of every insertion and erasure (a short critical section);
+    // - an erasure that moves an element whose key the background thread hasn't hashed yet
+    //   hashes kBackgroundRehashChunk keys, or waits while the background thread hashes them;
+    // - the same for all keys not hashed yet, if data_ runs out of capacity reserved at the
+    //   start of the rehash, as it can't be reallocated while the background thread reads it;
+    // - if the old table reaches twice the maximal load before the new one is ready, the
+    //   rehash is dropped and hash table is rebuilt in place, which is amortized by
+    //   the insertions that overloaded it.
+    // Reseed, clear and rehash cancel background rehash in progress and join the background
+    // thread, which stops after the chunk it is working on and frees its partial table.
+    // Disabling doesn't affect background rehash in progress.
+    // Complexity: O(1) guaranteed.
+    void set_background_rehash(const bool enabled) {
+        background_rehash_ = enabled;
+    }
+
+    // Complexity: O(1) guaranteed.
+    bool background_rehash() const {
+        return background_rehash_;
+    }
+
+    // Sets function called after every rehash with its HashMapRehashEvent; an empty function
+    // removes the callback. It is called by the thread that caused the rehash, right after
+    // the new hash table is installed, and must not modify the hash map. Copies of the hash
+    // map get a copy of the callback.
+    // Complexity: O(1) guaranteed.
+    void set_rehash_callback(std::function<void(const HashMapRehashEvent&)> callback) {
+        rehash_callback_ = std::move(callback);
+    }
+
+    // Rebuilds hash table with bucket_count buckets, clamped to the range allowed by resize
+    // policy for the current # of elements (so that the next operation doesn't resize it
+    // back). Also releases memory of buckets left over by erasures.
+    // Drops background rehash in progress.
+    // Complexity: O(# of elements in hash map + |hash_table|) average case.
+    void rehash(const size_t bucket_count) {
+        pending_rehash_.Reset();
+        size_t min_size = std::max((data_.size() + kMaxLoadFactor - 1) / kMaxLoadFactor,
+                                   static_cast<size_t>(kMinLoad));
+        size_t max_size = std::max(data_.size() * kMinLoadFactor, static_cast<size_t>(kMinLoad));
+        RebuildTable(std::min(std::max(bucket_count, min_size), max_size),
+                     HashMapRehashEvent::Trigger::kExplicit);
+    }
+
+    // Number of times hash function has been reseeded after a bucket exceeded
+    // kMaxChainLength. Hash maps whose hash function has no WithSeed or seed are never
+    // reseeded.
+    // Complexity: O(1) guaranteed.
+    size_t reseed_count() const {
+        return reseed_count_;
+    }
+
+    // Collects HashMapStats. Rehash counters cover resizes since construction of the hash map
+    // (or of the one it was copied from) and are not reset by clear.
+    // Complexity: O(# of elements in hash map + |hash_table|) guaranteed.
+    HashMapStats stats() const {
+        HashMapStats result;
+        result.element_count = data_.size();
+        result.bucket_count = hash_table_.size();
+        size_t successful_comparisons = 0;
+        size_t failed_comparisons = 0;
+        for (size_t bucket = 0; bucket < hash_table_.size(); ++bucket) {
+            size_t length = hash_table_[bucket].size();
+            if (result.chain_length_histogram.size() <= length) {
+                result.chain_length_histogram.resize(length + 1);
+            }
+            ++result.chain_length_histogram[length];
+            result.max_chain_length = std::max(result.max_chain_length, length);
+            const LongBucket* long_bucket = length > kUntreeifyThreshold ?
+                                            FindLongBucket(bucket) : nullptr;
+            if (long_bucket != nullptr) {
+                successful_comparisons += CountLongBucketComparisons(*long_bucket);
+            } else {
+                successful_comparisons += length * (length + 1) / 2;
+                failed_comparisons += length;
+            }
+        }
+        result.empty_bucket_count = result.chain_length_histogram.empty() ?
+                                    0 : result.chain_length_histogram[0];
+        result.long_bucket_count = long_buckets_.size();
+        if (result.bucket_count > result.empty_bucket_count) {
+            result.mean_chain_length = static_cast<double>(result.element_count) /
+                                       (result.bucket_count - result.empty_bucket_count);
+        }
+        if (result.bucket_count > 0) {
+            result.load_factor = static_cast<double>(result.element_count) / result.bucket_count;
+            result.failed_lookup_comparisons = static_cast<double>(failed_comparisons) /
+                                               result.bucket_count;
+        }
+        if (result.element_count > 0) {
+            result.successful_lookup_comparisons = static_cast<double>(successful_comparisons) /
+                                                   result.element_count;
+        }
+        result.rehash_count = rehash_count_;
+        result.rehash_time = rehash_time_;
+        result.reseed_count = reseed_count_;
+        return result;
+    }
+
+    // Collects HashMapMemoryUsage. Hash table being built by a background rehash
+    // is not included.
+    // Complexity: O(|hash_table| + # of long buckets) guaranteed.
+    HashMapMemoryUsage memory_usage() const {
+        HashMapMemoryUsage result;
+        result.object_bytes = sizeof(*this);
+        result.data_used_bytes = data_.size() * sizeof(KeyValuePair);
+        result.data_allocated_bytes = data_.capacity() * sizeof(KeyValuePair);
+        result.table_bytes = hash_table_.capacity() * sizeof(std::vector<size_t>);
+        size_t overhead = HashMapMemoryUsage::EstimateAllocatorOverhead(
+                result.data_allocated_bytes) +
+                HashMapMemoryUsage::EstimateAllocatorOverhead(result.table_bytes);
+        for (const std::vector<size_t>& bucket : hash_table_) {
+            size_t bytes = bucket.capacity() * sizeof(size_t);
+            result.bucket_bytes += bytes;
+            result.bucket_allocations += bytes > 0;
+            overhead += HashMapMemoryUsage::EstimateAllocatorOverhead(bytes);
+        }
+        size_t long_buckets_bytes = long_buckets_.capacity() * sizeof(LongBucket);
+        result.long_bucket_bytes = long_buckets_bytes;
+        overhead += HashMapMemoryUsage::EstimateAllocatorOverhead(long_buckets_bytes);
+        for (const LongBucket& long_bucket : long_buckets_) {
+            size_t bytes = long_bucket.entries.capacity() * sizeof(LongBucketEntry);
+            result.long_bucket_bytes += bytes;
+            overhead += HashMapMemoryUsage::EstimateAllocatorOverhead(bytes);
+        }
+        result.allocator_overhead_bytes = overhead;
+        result.total_bytes = result.object_bytes + result.data_allocated_bytes +
+                             result.table_bytes + result.bucket_bytes +
+                             result.long_bucket_bytes + result.allocator_overhead_bytes;
+        return result;
+    }
+
     // Complexity: O(1) guaranteed.
     Hash hash_function() const {
-        return hasher_;
+        return GetHasher();
+    }
+
+    // Complexity: O(1) guaranteed.
+    KeyEqual key_eq() const {
+        return GetKeyEqual();
     }
 
     // Complexity: O(1) guaranteed.
@@ -181,23 +700,124 @@ class HashMap {
         return data_.empty();
     }
 
+    // Number of buckets in hash table.
+    // Complexity: O(1) guaranteed.
+    size_t bucket_count() const {
+        return hash_table_.size();
+    }
+
     // Complexity: O(# of elements in hash map) guaranteed.
     void clear() {
+        std::chrono::steady_clock::time_point start;
+        if (rehash_callback_) {
+            start = std::chrono::steady_clock::now();
+        }
+        size_t old_bucket_count = hash_table_.size();
+        pending_rehash_.Reset();
         data_.clear();
+        hash_table_.clear();
+        long_buckets_.clear();
+        last_reseed_table_size_ = 0;
         RehashIfNecessary();
+        if (rehash_callback_) {
+            NotifyRehash(HashMapRehashEvent::Trigger::kClear, old_bucket_count,
+                         std::chrono::steady_clock::now() - start, false);
+        }
     }
 
     // Complexity: O(1) average case.
     // Inserts new element and resizes hash table if this is neccesary.
-    void insert(const KeyValuePair& element) {
-        size_t table_element_bucket = GetTableBucket(element.first);
-        iterator element_iterator = FindByTableBucket(table_element_bucket, element.first);
-        if (element_iterator != end()) {
-            return;
+    // Returns iterator to the element with key == Key (valid after the resize) and
+    // whether it was inserted.
+    std::pair<iterator, bool> insert(const KeyValuePair& element) {
+        return MakeInsertResult(
+                TryEmplaceWithHash(GetHasher()(element.first), element.first, element.second));
+    }
+
+    // Same as insert above, but key and value are moved into hash map
+    // (only if element is inserted).
+    // Complexity: O(1) average case.
+    std::pair<iterator, bool> insert(KeyValuePair&& element) {
+        return MakeInsertResult(TryEmplaceWithHash(GetHasher()(element.first),
+                                                   std::move(element.first),
+                                                   std::move(element.second)));
+    }
+
+    // Constructs element from args directly at the end of data_; it is destroyed again
+    // if its key is already present. Returns the same as insert.
+    // Complexity: O(1) average case.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return MakeInsertResult(EmplaceElement(std::forward<Args>(args)...));
+    }
+
+    // Inserts element with the given key and value constructed from args, if the key is not
+    // present yet. Otherwise neither key nor args are moved from. Returns the same as insert.
+    // Complexity: O(1) average case.
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const KeyType& key, Args&&... args) {
+        return MakeInsertResult(
+                TryEmplaceWithHash(GetHasher()(key), key, std::forward<Args>(args)...));
+    }
+
+    // Complexity: O(1) average case.
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(KeyType&& key, Args&&... args) {
+        return MakeInsertResult(
+                TryEmplaceWithHash(GetHasher()(key), std::move(key), std::forward<Args>(args)...));
+    }
+
+    // Same as try_emplace, with precomputed hash of the key.
+    // Complexity: O(1) average case.
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const PrehashedKey<KeyType>& key, Args&&... args) {
+        return MakeInsertResult(
+                TryEmplaceWithHash(GetPrehash(key), key.key, std::forward<Args>(args)...));
+    }
+
+    // Assigns value to the element with key == Key, inserting it if necessary.
+    // Returns iterator to the element and whether it was inserted.
+    // Complexity: O(1) average case.
+    template<class Value>
+    std::pair<iterator, bool> insert_or_assign(const KeyType& key, Value&& value) {
+        std::pair<size_t, bool> result =
+                TryEmplaceWithHash(GetHasher()(key), key, std::forward<Value>(value));
+        if (!result.second) {
+            data_[result.first].second = std::forward<Value>(value);
         }
-        hash_table_[table_element_bucket].push_back(data_.size());
-        data_.push_back(element);
-        RehashIfNecessary();
+        return MakeInsertResult(result);
+    }
+
+    // Complexity: O(1) average case.
+    template<class Value>
+    std::pair<iterator, bool> insert_or_assign(KeyType&& key, Value&& value) {
+        std::pair<size_t, bool> result =
+                TryEmplaceWithHash(GetHasher()(key), std::move(key), std::forward<Value>(value));
+        if (!result.second) {
+            data_[result.first].second = std::forward<Value>(value);
+        }
+        return MakeInsertResult(result);
+    }
+
+    // Same as insert_or_assign, with precomputed hash of the key.
+    // Complexity: O(1) average case.
+    template<class Value>
+    std::pair<iterator, bool> insert_or_assign(const PrehashedKey<KeyType>& key, Value&& value) {
+        std::pair<size_t, bool> result =
+                TryEmplaceWithHash(GetPrehash(key), key.key, std::forward<Value>(value));
+        if (!result.second) {
+            data_[result.first].second = std::forward<Value>(value);
+        }
+        return MakeInsertResult(result);
+    }
+
+    // Inserts all elements of the range, elements with already present keys are skipped.
+    // If hash function provides HashBatch (e.g. IntegerHash), keys are hashed in groups
+    // of kLookupGroupSize elements with a single HashBatch call.
+    // Complexity: O(end - begin) average case.
+    template<class Iter>
+    void insert(Iter begin, Iter end) {
+        InsertRange(GetHasher(), begin, end, 0);
     }
 
     // Complexity: O(1) average case.
@@ -206,50 +826,64 @@ class HashMap {
     // 2) Remove last element from the array.
     // 3) Update hash table according to changes made with the storage array.
     void erase(const KeyType& key) {
-        size_t key_bucket = GetTableBucket(key);
-        iterator key_iterator = FindByTableBucket(key_bucket, key);
-        if (key_iterator == end()) {
-            return;
-        }
-        size_t key_data_position = GetDataPosition(key_iterator);
-        auto bucket_key_position = std::find(hash_table_[key_bucket].begin(),
-                                             hash_table_[key_bucket].end(), key_data_position);
-        hash_table_[key_bucket].erase(bucket_key_position);
-        size_t last_element_bucket = GetTableBucket(data_.back().first);
-
-        std::swap(data_[key_data_position], data_.back());
-        data_.pop_back();
+        EraseKey(key, GetHasher()(key));
+    }
 
-        auto last_element_bucket_position = std::find(hash_table_[last_element_bucket].begin(),
-                                                      hash_table_[last_element_bucket].end(),
-                                                      data_.size());
-        *last_element_bucket_position = key_data_position;
+    // Complexity: O(1) average case.
+    void erase(const PrehashedKey<KeyType>& key) {
+        EraseKey(key.key, GetPrehash(key));
+    }
 
-        RehashIfNecessary();
+    // Complexity: O(1) average case.
+    template<class Key, class HashFunction = Hash, class Equal = KeyEqual,
+             class = typename HashFunction::is_transparent,
+             class = typename Equal::is_transparent>
+    void erase(const Key& key) {
+        EraseKey(key, GetHasher()(key));
     }
 
     // Return element of hash map with Key == key if it exists.
     // Otherwise create element with Key = key and Value set with default value of Valuetype.
     // Complexity: O(1) average case.
     ValueType& operator[](const KeyType& key) {
-        size_t table_key_bucket = GetTableBucket(key);
-        iterator key_iterator = FindByTableBucket(table_key_bucket, key);
+        return data_[TryEmplaceWithHash(GetHasher()(key), key).first].second;
+    }
+
+    // Same as operator[] above, but key is moved into hash map if element is created.
+    // Complexity: O(1) average case.
+    ValueType& operator[](KeyType&& key) {
+        return data_[TryEmplaceWithHash(GetHasher()(key), std::move(key)).first].second;
+    }
+
+    // Same as operator[], with precomputed hash of the key.
+    // Complexity: O(1) average case.
+    ValueType& operator[](const PrehashedKey<KeyType>& key) {
+        return data_[TryEmplaceWithHash(GetPrehash(key), key.key).first].second;
+    }
+
+    // Complexity: O(1) average.
+    const ValueType& at(const KeyType& key) const {
+        const_iterator key_iterator = find(key);
         if (key_iterator != end()) {
             return key_iterator->second;
         }
-        hash_table_[table_key_bucket].push_back(data_.size());
-        size_t last_element_index = data_.size();
-        data_.push_back({key, ValueType()});
-        key_iterator = iterator(data_.begin() + last_element_index);
+        throw std::out_of_range("Element not in HashTable.");
+    }
 
-        if (RehashIfNecessary()) {
-            return find(key)->second;
+    // Complexity: O(1) average.
+    const ValueType& at(const PrehashedKey<KeyType>& key) const {
+        const_iterator key_iterator = find(key);
+        if (key_iterator != end()) {
+            return key_iterator->second;
         }
-        return key_iterator->second;
+        throw std::out_of_range("Element not in HashTable.");
     }
 
     // Complexity: O(1) average.
-    const ValueType& at(const KeyType& key) const {
+    template<class Key, class HashFunction = Hash, class Equal = KeyEqual,
+             class = typename HashFunction::is_transparent,
+             class = typename Equal::is_transparent>
+    const ValueType& at(const Key& key) const {
         const_iterator key_iterator = find(key);
         if (key_iterator != end()) {
             return key_iterator->second;
@@ -258,76 +892,1264 @@ class HashMap {
     }
 
   private:
-    // Returns index in data_ array, that corresponds to the given iterator.
-    // Complexity: O(1) guaranteed.
-    size_t GetDataPosition(const iterator& it){
-        return it.position_ - begin().position_;
-    }
+    // Stages of a single lookup of find_batch. Every stage ends with a prefetch of memory
+    // needed by the next one.
+    enum class LookupStage {
+        kHashBucket,
+        kLoadChain,
+        kLoadSlot,
+        kCompareSlot,
+        kDone
+    };
 
-    // Calculates position of bucket of hash table, where element with key = Key belongs.
-    // Complexity: O(1) guaranteed.
-    size_t GetTableBucket(const KeyType& key) const {
-        return hasher_(key) % hash_table_.size();
-    }
+    struct LookupState {
+        size_t key_index;
+        size_t bucket;
+        size_t chain_position;
+        LookupStage stage;
+    };
 
-    // Checks where resize of hash table is necessary and resizes it accordingly.
-    // Returns true bool value whether hash table has been rehashed.
-    // Complexity: O(|hash_table|)  guaranteed if we perform rehash;
-    // otherwise O(1) guaranteed.
-    // Also used for initialization.
-    // Resize policy: we maintan invariant that:
-    // kMinLoadFactor < # of buckets in hash table / # of elements in hash map < 1/kMaxLoadFactor.
-    // More precisely, invariant above holds only if # of elements in hash map >= kMinLoad;
-    // otherwise we store kMinLoad buckets (KMinLoad > 0).
-    bool RehashIfNecessary() {
-        if (hash_table_.empty() && data_.empty()) {
-            hash_table_.resize(kMinLoad);
-            return true;
-        }
-        if (hash_table_.size() * kMaxLoadFactor < data_.size() ||
-            data_.size() * kMinLoadFactor < hash_table_.size()) {
+    // Long-bucket index: every bucket longer than kTreeifyThreshold has a LongBucket, and
+    // long_buckets_ keeps them ordered by bucket number, so the LongBucket of a bucket is
+    // found by binary search. The index is rebuilt together with hash_table_
+    // (RebuildLongBuckets) and kept up to date by insertions and erasures (AddToLongBucket,
+    // RemoveFromLongBucket, RenumberInLongBucket).
+    // (hash, index in data_) of an element of a long bucket.
+    using LongBucketEntry = std::pair<size_t, size_t>;
 
-            size_t new_size = std::max(data_.size(), static_cast<size_t>(kMinLoad));
-            if (hash_table_.size() == new_size) {
-                return false;
-            }
+    // Sorted index of a bucket longer than kTreeifyThreshold: entries of all its elements
+    // ordered by hash and, if keys are ordered consistently with key equality
+    // (see OrderedKeys), by key. Bucket itself keeps all its elements as well, so
+    // the index is used only by lookups that know the hash of the key.
+    struct LongBucket {
+        size_t bucket;
+        std::vector<LongBucketEntry> entries;
+    };
 
-            hash_table_.clear();
-            hash_table_.resize(new_size);
+    // Whether keys can be compared with operator<: LongBucket uses it to order elements
+    // with equal hashes, if key equality is the one of operator== (std::equal_to).
+    template<class Key>
+    struct HasLess {
+        template<class Other>
+        static auto Test(int)
+                -> decltype(std::declval<const Other&>() < std::declval<const Other&>(),
+                            std::true_type());
 
-            for (size_t ind = 0; ind < data_.size(); ++ind) {
-                size_t hash_table_position = GetTableBucket(data_[ind].first);
-                hash_table_[hash_table_position].push_back(ind);
-            }
-            return true;
-        }
-        return false;
-    }
+        template<class Other>
+        static std::false_type Test(long);
 
-    // Finds iterator that has key == Key when bucket where element with key = Key is given.
-    // Complexity: O(1) average case.
-    iterator FindByTableBucket(const size_t key_bucket, const KeyType& key) {
-        for (size_t data_index : hash_table_[key_bucket]) {
-            if (data_[data_index].first == key) {
-                return iterator(data_.begin() + data_index);
-            }
-        }
-        return end();
-    }
+        constexpr static bool value = decltype(Test<Key>(0))::value;
+    };
 
-    // Finds iterator that has key == Key when bucket where element with key = Key is given.
-    // Complexity: O(1) average case.
-    const_iterator FindByTableBucket(const size_t key_bucket, const KeyType& key) const {
-        for (size_t data_index : hash_table_[key_bucket]) {
-            if (data_[data_index].first == key) {
-                return const_iterator(data_.cbegin() + data_index);
+    // std::equal_to<> is C++14.
+    using OrderedKeys = std::integral_constant<bool, HasLess<KeyType>::value &&
+            (std::is_same<KeyEqual, std::equal_to<KeyType>>::value
+#if __cplusplus >= 201402L
+             || std::is_same<KeyEqual, std::equal_to<>>::value
+#endif
+            )>;
+
+    // Change of data_ made during background rehash, replayed by the background thread:
+    // element with the given hash appended at position, or (if erase) element with the given
+    // hash erased from position and the last element, at last_position, moved in its place.
+    struct RehashDelta {
+        bool erase;
+        size_t position;
+        size_t hash;
+        size_t last_position;
+        size_t last_hash;
+    };
+
+    // Background rehash, shared by the mutating thread (owner) and the background thread
+    // (worker). The worker hashes keys of the first element_count elements of data_ chunk
+    // by chunk, builds new hash table from the hashes, then replays deltas logged by the
+    // owner and waits for more, until the owner either installs the table (leaving the old
+    // one in its place for the worker to free) or cancels the rehash. The owner may hash a
+    // chunk itself (see ClaimRehashChunk); once all chunks are hashed, the worker never
+    // reads data_ again. The owner holds the state and joins the worker before freeing it.
+    struct PendingRehash {
+        enum ChunkState : uint8_t { kFree, kClaimed, kHashed };
+
+        PendingRehash(const KeyValuePair* data, const size_t element_count,
+                      const size_t new_size, const Hash& hasher) :
+                data(data), element_count(element_count), new_size(new_size), hasher(hasher),
+                hashes(new size_t[element_count]),
+                chunk_count((element_count + kBackgroundRehashChunk - 1) /
+                            kBackgroundRehashChunk),
+                chunks(new std::atomic<uint8_t>[chunk_count]) {
+            for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+                chunks[chunk].store(kFree, std::memory_order_relaxed);
             }
         }
-        return end();
-    }
 
-  private:
-    std::vector<std::vector<size_t>> hash_table_;
-    std::vector<KeyValuePair> data_;
-    Hash hasher_;
-};
+        const KeyValuePair* const data;
+        const size_t element_count;
+        const size_t new_size;
+        const Hash hasher;
+        // hashes of a chunk are written by the thread that claimed it.
+        const std::unique_ptr<size_t[]> hashes;
+        const size_t chunk_count;
+        const std::unique_ptr<std::atomic<uint8_t>[]> chunks;
+        std::atomic<size_t> hashed_chunks{0};
+        std::atomic<bool> cancelled{false};
+        std::thread worker;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        // Guarded by mutex.
+        std::vector<RehashDelta> deltas;
+        // Worker has replayed all deltas and waits.
+        bool ready = false;
+        // Table has been installed or the rehash cancelled; worker frees what it holds
+        // and exits.
+        bool finished = false;
+        // Owned by the worker until it is ready; after installation they hold the old table
+        // and its long-bucket index.
+        std::vector<std::vector<size_t>> table;
+        std::vector<LongBucket> long_buckets;
+        // Buckets of table that may be longer than kTreeifyThreshold (with repetitions).
+        std::vector<size_t> long_bucket_candidates;
+    };
+
+    // Owner of the background rehash in progress. Copies of hash map don't inherit it, as
+    // the hash table they copy is always complete. Assignment and destruction cancel it,
+    // joining the background thread, which reads keys from the buffer of data_;
+    // for this reason it must be the first member of HashMap (and destructor of HashMap
+    // resets it explicitly). Nothing is allocated unless a background rehash is started.
+    class PendingRehashHolder {
+      public:
+        PendingRehashHolder() = default;
+
+        PendingRehashHolder(const PendingRehashHolder&) {}
+
+        PendingRehashHolder(PendingRehashHolder&& other) = default;
+
+        PendingRehashHolder& operator=(const PendingRehashHolder&) {
+            Reset();
+            return *this;
+        }
+
+        PendingRehashHolder& operator=(PendingRehashHolder&& other) {
+            Reset();
+            pending = std::move(other.pending);
+            installed = std::move(other.installed);
+            return *this;
+        }
+
+        ~PendingRehashHolder() {
+            Reset();
+        }
+
+        // Cancels background rehash in progress and joins all background threads.
+        // Complexity: O(# of chunks) guaranteed plus the time the workers take to stop.
+        void Reset() {
+            if (pending) {
+                CancelRehash(*pending);
+                pending.reset();
+            }
+            JoinInstalled();
+        }
+
+        // Joins the worker of the last installed rehash, which frees the old table.
+        // Complexity: O(1) guaranteed plus the time the worker takes to free the table.
+        void JoinInstalled() {
+            if (installed) {
+                installed->worker.join();
+                installed.reset();
+            }
+        }
+
+        // Background rehash in progress, nullptr if there is none.
+        std::unique_ptr<PendingRehash> pending;
+        // Installed rehash whose worker may still be freeing the old table; it is joined
+        // when the next background rehash starts or the holder is reset, so that the owner
+        // doesn't wait for the table to be freed.
+        std::unique_ptr<PendingRehash> installed;
+    };
+
+    using Functions = HashMapFunctions<Hash, KeyEqual>;
+
+  private:
+    // Complexity: O(1) guaranteed.
+    const Hash& GetHasher() const {
+        return functions_.hasher();
+    }
+
+    // Complexity: O(1) guaranteed.
+    const KeyEqual& GetKeyEqual() const {
+        return functions_.key_equal();
+    }
+
+    // Returns index in data_ array, that corresponds to the given iterator.
+    // Complexity: O(1) guaranteed.
+    size_t GetDataPosition(const iterator& it){
+        return it.position_ - begin().position_;
+    }
+
+    // Seed of the given hash function, 0 if it has no seed().
+    // Complexity: O(1) guaranteed.
+    template<class HashFunction>
+    static auto GetHashSeed(const HashFunction& hasher, int) -> decltype(uint64_t(hasher.seed())) {
+        return hasher.seed();
+    }
+
+    template<class HashFunction>
+    static uint64_t GetHashSeed(const HashFunction&, long) {
+        return 0;
+    }
+
+    // Hash of a prehashed key under the current hash function.
+    // Complexity: O(1) guaranteed (assuming hash computation is O(1)).
+    size_t GetPrehash(const PrehashedKey<KeyType>& key) const {
+        return key.seed == GetHashSeed(GetHasher(), 0) ? key.hash : GetHasher()(key.key);
+    }
+
+    // Calculates position of bucket of hash table, where element with key = Key belongs.
+    // Complexity: O(1) guaranteed.
+    template<class Key>
+    size_t GetTableBucket(const Key& key) const {
+        return GetTableBucketByHash(GetHasher()(key));
+    }
+
+    // Same as GetTableBucket, when hash of the key is already known.
+    // Complexity: O(1) guaranteed.
+    size_t GetTableBucketByHash(const size_t hash) const {
+        return hash % hash_table_.size();
+    }
+
+    // Appends element with the given key (whose hash is known) and value constructed
+    // from args, if the key is not present yet; key and args are used only in this case.
+    // Returns index of the element with key == Key in data_ and whether it was appended.
+    // Index stays valid after rehash, as rehash never moves elements of data_.
+    // Complexity: O(1) average case.
+    template<class Key, class... Args>
+    std::pair<size_t, bool> TryEmplaceWithHash(const size_t hash, Key&& key, Args&&... args) {
+        PrepareAppend();
+        size_t table_key_bucket = GetTableBucketByHash(hash);
+        iterator key_iterator = FindByTableBucket(table_key_bucket, hash, key);
+        if (key_iterator != end()) {
+            return {GetDataPosition(key_iterator), false};
+        }
+        size_t position = data_.size();
+        data_.emplace_back(std::piecewise_construct,
+                           std::forward_as_tuple(std::forward<Key>(key)),
+                           std::forward_as_tuple(std::forward<Args>(args)...));
+        hash_table_[table_key_bucket].push_back(position);
+        AddToLongBucket(table_key_bucket, hash, position);
+        LogRehashDelta({false, position, hash, 0, 0});
+        HASHMAP_COUNT(kInserts, 1);
+        CheckChainLength(table_key_bucket);
+        RehashIfNecessary();
+        return {position, true};
+    }
+
+    // Converts result of TryEmplaceWithHash or EmplaceElement to the one of insert.
+    // Complexity: O(1) guaranteed.
+    std::pair<iterator, bool> MakeInsertResult(const std::pair<size_t, bool> result) {
+        return {iterator(data_.begin() + result.first), result.second};
+    }
+
+    // Reseeds hash function if the given bucket has grown beyond kMaxChainLength.
+    // Complexity: O(1) guaranteed, if no reseed is necessary.
+    void CheckChainLength(const size_t bucket) {
+        if (hash_table_[bucket].size() > kMaxChainLength) {
+            Reseed(GetHasher(), 0);
+        }
+    }
+
+    // Replaces hash function with its copy with a new random seed and rebuilds hash table.
+    // Hash table of the same size is reseeded only once: if its chains are still too long,
+    // keys collide under every seed (e.g. they are equal modulo # of buckets for a hash
+    // function with poor low bits), and further reseeds would only waste time.
+    // Background rehash in progress is dropped, as it uses the old hash function.
+    // Hash function must report its seed as well, so that PrehashedKey computed before
+    // the reseed is recognized as stale.
+    // Complexity: O(# of elements in hash map + |hash_table|) average case.
+    template<class HashFunction>
+    auto Reseed(const HashFunction& hasher, int)
+            -> decltype(hasher.WithSeed(uint64_t()), uint64_t(hasher.seed()), void()) {
+        if (last_reseed_table_size_ == hash_table_.size()) {
+            return;
+        }
+        last_reseed_table_size_ = hash_table_.size();
+        pending_rehash_.Reset();
+        functions_ = Functions(hasher.WithSeed(RandomSeed::Next()), GetKeyEqual());
+        ++reseed_count_;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<size_t>> table(hash_table_.size());
+        FillTable(table);
+        hash_table_.swap(table);
+        RebuildLongBuckets();
+        std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+        rehash_time_ += duration;
+        NotifyRehash(HashMapRehashEvent::Trigger::kReseed, hash_table_.size(), duration, false);
+    }
+
+    // Hash functions without WithSeed and seed can't be reseeded.
+    template<class HashFunction>
+    void Reseed(const HashFunction&, long) {}
+
+    // Constructs element from args at the end of data_ and keeps it, if its key
+    // is not present yet. Returns the same as TryEmplaceWithHash.
+    // Complexity: O(1) average case.
+    template<class... Args>
+    std::pair<size_t, bool> EmplaceElement(Args&&... args) {
+        PrepareAppend();
+        size_t position = data_.size();
+        data_.emplace_back(std::forward<Args>(args)...);
+        size_t hash = GetHasher()(data_.back().first);
+        size_t table_key_bucket = GetTableBucketByHash(hash);
+        iterator key_iterator = FindByTableBucket(table_key_bucket, hash, data_.back().first);
+        if (key_iterator != end()) {
+            data_.pop_back();
+            return {GetDataPosition(key_iterator), false};
+        }
+        hash_table_[table_key_bucket].push_back(position);
+        AddToLongBucket(table_key_bucket, hash, position);
+        LogRehashDelta({false, position, hash, 0, 0});
+        HASHMAP_COUNT(kInserts, 1);
+        CheckChainLength(table_key_bucket);
+        RehashIfNecessary();
+        return {position, true};
+    }
+
+    // Writes hashes of all keys to hashes, using HashBatch of hash function if it exists.
+    // Complexity: O(# of keys) guaranteed.
+    template<class HashFunction>
+    static auto HashKeys(const HashFunction& hasher, const std::vector<KeyType>& keys,
+                         std::vector<size_t>& hashes, int)
+            -> decltype(hasher.HashBatch(keys.data(), keys.size(), hashes.data()), void()) {
+        hasher.HashBatch(keys.data(), keys.size(), hashes.data());
+    }
+
+    template<class HashFunction>
+    static void HashKeys(const HashFunction& hasher, const std::vector<KeyType>& keys,
+                         std::vector<size_t>& hashes, long) {
+        for (size_t ind = 0; ind < keys.size(); ++ind) {
+            hashes[ind] = hasher(keys[ind]);
+        }
+    }
+
+    // Range insertion for hash functions with HashBatch: elements are buffered in groups
+    // of kLookupGroupSize and keys of each group are hashed at once.
+    // Complexity: O(end - begin) average case.
+    template<class HashFunction, class Iter>
+    auto InsertRange(const HashFunction& hasher, Iter begin, Iter end, int)
+            -> decltype(hasher.HashBatch(static_cast<const KeyType*>(nullptr), 0,
+                                         static_cast<size_t*>(nullptr)), void()) {
+        std::vector<KeyValuePair> group;
+        std::vector<KeyType> keys;
+        std::vector<size_t> hashes(kLookupGroupSize);
+        group.reserve(kLookupGroupSize);
+        keys.reserve(kLookupGroupSize);
+        while (begin != end) {
+            group.clear();
+            keys.clear();
+            for (; begin != end && group.size() < kLookupGroupSize; ++begin) {
+                group.push_back(*begin);
+                keys.push_back(group.back().first);
+            }
+            hasher.HashBatch(keys.data(), keys.size(), hashes.data());
+            for (size_t ind = 0; ind < group.size(); ++ind) {
+                size_t reseed_count = reseed_count_;
+                TryEmplaceWithHash(hashes[ind], std::move(group[ind].first),
+                                   std::move(group[ind].second));
+                if (reseed_count != reseed_count_ && ind + 1 < group.size()) {
+                    // hasher refers to the current hash function of the map.
+                    hasher.HashBatch(keys.data() + ind + 1, keys.size() - ind - 1,
+                                     hashes.data() + ind + 1);
+                }
+            }
+        }
+    }
+
+    template<class HashFunction, class Iter>
+    void InsertRange(const HashFunction& hasher, Iter begin, Iter end, long) {
+        for (; begin != end; ++begin) {
+            const KeyValuePair& element = *begin;
+            TryEmplaceWithHash(hasher(element.first), element.first, element.second);
+        }
+    }
+
+    // Implementation of erase for keys of any type accepted by hash function.
+    // Complexity: O(1) average case.
+    template<class Key>
+    void EraseKey(const Key& key, const size_t hash) {
+        if (EraseWithoutRehash(key, hash)) {
+            RehashIfNecessary();
+        }
+    }
+
+    // Erase without resize of hash table, which never reallocates any of the arrays.
+    // Returns whether element with key == Key existed.
+    // Complexity: O(1) average case.
+    template<class Key>
+    bool EraseWithoutRehash(const Key& key) {
+        return EraseWithoutRehash(key, GetHasher()(key));
+    }
+
+    // Same as above, when hash of the key is already known.
+    // Complexity: O(1) average case.
+    template<class Key>
+    bool EraseWithoutRehash(const Key& key, const size_t hash) {
+        size_t key_bucket = GetTableBucketByHash(hash);
+        iterator key_iterator = FindByTableBucket(key_bucket, hash, key);
+        if (key_iterator == end()) {
+            return false;
+        }
+        size_t key_data_position = GetDataPosition(key_iterator);
+        size_t last_position = data_.size() - 1;
+        ProtectFromPendingRehash(key_data_position);
+        ProtectFromPendingRehash(last_position);
+        auto bucket_key_position = std::find(hash_table_[key_bucket].begin(),
+                                             hash_table_[key_bucket].end(), key_data_position);
+        hash_table_[key_bucket].erase(bucket_key_position);
+        RemoveFromLongBucket(key_bucket, hash, key_data_position);
+        HASHMAP_COUNT(kErases, 1);
+        if (key_data_position == last_position) {
+            data_.pop_back();
+            LogRehashDelta({true, key_data_position, hash, last_position, hash});
+            return true;
+        }
+        size_t last_element_hash = GetHasher()(data_.back().first);
+        size_t last_element_bucket = GetTableBucketByHash(last_element_hash);
+
+        std::swap(data_[key_data_position], data_.back());
+        data_.pop_back();
+        HASHMAP_COUNT(kEraseBytesMoved, sizeof(KeyValuePair));
+
+        auto last_element_bucket_position = std::find(hash_table_[last_element_bucket].begin(),
+                                                      hash_table_[last_element_bucket].end(),
+                                                      data_.size());
+        *last_element_bucket_position = key_data_position;
+        RenumberInLongBucket(last_element_bucket, last_element_hash, data_.size(),
+                             key_data_position);
+        LogRehashDelta({true, key_data_position, hash, last_position, last_element_hash});
+        return true;
+    }
+
+    // Checks where resize of hash table is necessary and resizes it accordingly.
+    // Returns true bool value whether hash table has been rehashed.
+    // Complexity: O(|hash_table|)  guaranteed if we perform rehash;
+    // otherwise O(1) guaranteed.
+    // Also used for initialization.
+    // If rehash_threads_ > 1 and hash map is large enough, hash table is rebuilt in parallel.
+    // If background rehash is enabled, growth of a large hash table is only started here,
+    // and background rehash in progress is installed once the worker has caught up.
+    // Resize policy: we maintan invariant that:
+    // kMinLoadFactor < # of buckets in hash table / # of elements in hash map < 1/kMaxLoadFactor.
+    // More precisely, invariant above holds only if # of elements in hash map >= kMinLoad;
+    // otherwise we store kMinLoad buckets (KMinLoad > 0).
+    bool RehashIfNecessary() {
+        if (hash_table_.empty() && data_.empty()) {
+            hash_table_.resize(kMinLoad);
+            return true;
+        }
+        bool rehashed = false;
+        bool in_place = false;
+        if (pending_rehash_.pending) {
+            if (TryInstallPendingRehash()) {
+                rehashed = true;
+            } else if (data_.size() <= 2 * kMaxLoadFactor * hash_table_.size()) {
+                return false;
+            } else {
+                // The worker is too slow: rebuild in place, as if there were no worker.
+                pending_rehash_.Reset();
+                in_place = true;
+            }
+        }
+        size_t new_size = GetNewTableSize();
+        if (hash_table_.size() == new_size) {
+            return rehashed;
+        }
+        HASHMAP_COUNT(kGrowRehashes, new_size > hash_table_.size());
+        HASHMAP_COUNT(kShrinkRehashes, new_size < hash_table_.size());
+
+        if (background_rehash_ && !in_place && new_size > hash_table_.size() &&
+            data_.size() >= kMinBackgroundRehashSize) {
+            StartBackgroundRehash(new_size);
+            return rehashed;
+        }
+
+        RebuildTable(new_size, new_size > hash_table_.size() ?
+                               HashMapRehashEvent::Trigger::kGrow :
+                               HashMapRehashEvent::Trigger::kShrink);
+        return true;
+    }
+
+    // Rebuilds hash table with new_size buckets in the calling thread (in parallel,
+    // if rehash_threads_ > 1 and hash map is large enough).
+    // Complexity: O(# of elements in hash map + new_size) average case.
+    void RebuildTable(const size_t new_size, const HashMapRehashEvent::Trigger trigger) {
+        auto start = std::chrono::steady_clock::now();
+        size_t old_bucket_count = hash_table_.size();
+        size_t num_threads = GetBuildThreads(rehash_threads_, data_.size());
+        if (num_threads > 1) {
+            BuildTableParallel(new_size, num_threads, false);
+        } else {
+            hash_table_.clear();
+            hash_table_.resize(new_size);
+            FillTable(hash_table_);
+        }
+        RebuildLongBuckets();
+        ++rehash_count_;
+        std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+        rehash_time_ += duration;
+        NotifyRehash(trigger, old_bucket_count, duration, false);
+    }
+
+    // Complexity: O(1) guaranteed plus the callback.
+    void NotifyRehash(const HashMapRehashEvent::Trigger trigger, const size_t old_bucket_count,
+                      const std::chrono::nanoseconds duration, const bool background) const {
+        if (rehash_callback_) {
+            rehash_callback_(HashMapRehashEvent{trigger, old_bucket_count, hash_table_.size(),
+                                                data_.size(), duration, background});
+        }
+    }
+
+    // Starts building hash table with new_size buckets for current elements in a background
+    // thread. Reserves capacity of data_, so that it isn't reallocated while the thread reads
+    // keys from it (see PrepareAppend). The reserve reallocates data_ in the calling thread,
+    // O(# of elements), only if its capacity is below twice the maximal load of the current
+    // table; data_ would reach that capacity by doubling anyway within the next insertions,
+    // so it is the same reallocation made earlier.
+    // Complexity: O(1) amortized.
+    void StartBackgroundRehash(const size_t new_size) {
+        pending_rehash_.JoinInstalled();
+        data_.reserve(std::max(data_.capacity(), 2 * kMaxLoadFactor * hash_table_.size() + 1));
+        std::unique_ptr<PendingRehash> pending(
+                new PendingRehash(data_.data(), data_.size(), new_size, GetHasher()));
+        pending->worker = std::thread(&HashMap::RunBackgroundRehash, pending.get());
+        pending_rehash_.pending = std::move(pending);
+    }
+
+    // Body of the background thread (see PendingRehash). Checks cancelled between chunks
+    // of work, so that the owner joining it after a cancellation doesn't wait long.
+    // Complexity: O(# of elements in hash map + new_size + # of deltas) average case.
+    static void RunBackgroundRehash(PendingRehash* const state) {
+        for (size_t chunk = 0; chunk < state->chunk_count; ++chunk) {
+            if (state->cancelled.load(std::memory_order_acquire)) {
+                break;
+            }
+            uint8_t expected = PendingRehash::kFree;
+            if (state->chunks[chunk].compare_exchange_strong(expected, PendingRehash::kClaimed,
+                                                             std::memory_order_acq_rel)) {
+                HashRehashChunk(*state, chunk);
+            }
+        }
+        bool cancelled = !WaitForRehashChunks(*state) || !BuildRehashTable(*state);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (!state->finished) {
+            if (!cancelled && !state->deltas.empty()) {
+                std::vector<RehashDelta> deltas;
+                deltas.swap(state->deltas);
+                lock.unlock();
+                for (size_t ind = 0; ind < deltas.size() && !cancelled; ++ind) {
+                    ApplyRehashDelta(*state, deltas[ind]);
+                    if (ind % kBackgroundRehashChunk == 0) {
+                        cancelled = state->cancelled.load(std::memory_order_acquire);
+                    }
+                }
+                lock.lock();
+                continue;
+            }
+            state->ready = !cancelled;
+            state->changed.wait(lock);
+        }
+        // Either the old table after installation, or the unused new one.
+        std::vector<std::vector<size_t>> table;
+        std::vector<LongBucket> long_buckets;
+        table.swap(state->table);
+        long_buckets.swap(state->long_buckets);
+        lock.unlock();
+    }
+
+    // Hashes keys of the given chunk of elements, claimed by the calling thread.
+    // Complexity: O(kBackgroundRehashChunk) guaranteed.
+    static void HashRehashChunk(PendingRehash& state, const size_t chunk) {
+        size_t chunk_end = std::min(state.element_count, (chunk + 1) * kBackgroundRehashChunk);
+        for (size_t ind = chunk * kBackgroundRehashChunk; ind < chunk_end; ++ind) {
+            state.hashes[ind] = state.hasher(state.data[ind].first);
+        }
+        state.chunks[chunk].store(PendingRehash::kHashed, std::memory_order_release);
+        state.hashed_chunks.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // Waits until every chunk is hashed (by the owner or by the worker itself).
+    // Returns false if the rehash is cancelled meanwhile.
+    // Complexity: O(# of chunks) guaranteed plus waiting time.
+    static bool WaitForRehashChunks(PendingRehash& state) {
+        while (state.hashed_chunks.load(std::memory_order_acquire) < state.chunk_count) {
+            if (state.cancelled.load(std::memory_order_acquire)) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return !state.cancelled.load(std::memory_order_acquire);
+    }
+
+    // Builds new table of the worker from the hashes.
+    // Returns false if the rehash is cancelled meanwhile.
+    // Complexity: O(# of hashes + new_size) average case.
+    static bool BuildRehashTable(PendingRehash& state) {
+        std::vector<std::vector<size_t>> table(state.new_size);
+        for (size_t ind = 0; ind < state.element_count; ++ind) {
+            if (ind % kBackgroundRehashChunk == 0 &&
+                state.cancelled.load(std::memory_order_acquire)) {
+                return false;
+            }
+            table[state.hashes[ind] % state.new_size].push_back(ind);
+        }
+        for (size_t bucket = 0; bucket < table.size(); ++bucket) {
+            if (table[bucket].size() > kTreeifyThreshold) {
+                state.long_bucket_candidates.push_back(bucket);
+            }
+        }
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.table.swap(table);
+        return true;
+    }
+
+    // Replays change of data_ on the table of the worker.
+    // Complexity: O(1) average case.
+    static void ApplyRehashDelta(PendingRehash& state, const RehashDelta& delta) {
+        std::vector<std::vector<size_t>>& table = state.table;
+        std::vector<size_t>& bucket = table[delta.hash % table.size()];
+        if (!delta.erase) {
+            bucket.push_back(delta.position);
+            if (bucket.size() > kTreeifyThreshold) {
+                state.long_bucket_candidates.push_back(delta.hash % table.size());
+            }
+            return;
+        }
+        bucket.erase(std::find(bucket.begin(), bucket.end(), delta.position));
+        if (delta.position != delta.last_position) {
+            std::vector<size_t>& last_bucket = table[delta.last_hash % table.size()];
+            *std::find(last_bucket.begin(), last_bucket.end(), delta.last_position) =
+                    delta.position;
+        }
+    }
+
+    // Makes sure that the worker has hashed (or will never read) the key at the given
+    // position of data_, so that it can be moved or destroyed: hashes its chunk if nobody
+    // has claimed it yet, waits for the worker otherwise.
+    // Complexity: O(kBackgroundRehashChunk) guaranteed plus waiting for the worker to hash
+    // at most kBackgroundRehashChunk keys.
+    static void ClaimRehashChunk(PendingRehash& state, const size_t chunk, const bool hash) {
+        uint8_t expected = PendingRehash::kFree;
+        if (state.chunks[chunk].compare_exchange_strong(expected, PendingRehash::kClaimed,
+                                                        std::memory_order_acq_rel)) {
+            if (hash) {
+                HashRehashChunk(state, chunk);
+            }
+            return;
+        }
+        while (expected == PendingRehash::kClaimed) {
+            std::this_thread::yield();
+            expected = state.chunks[chunk].load(std::memory_order_acquire);
+        }
+    }
+
+    // Cancels background rehash and joins the worker, which stops after the chunk of work
+    // it is doing and frees its table.
+    // Complexity: O(# of chunks) guaranteed plus waiting for the worker to process at most
+    // kBackgroundRehashChunk elements and to free its table.
+    static void CancelRehash(PendingRehash& state) {
+        state.cancelled.store(true, std::memory_order_release);
+        for (size_t chunk = 0; chunk < state.chunk_count; ++chunk) {
+            ClaimRehashChunk(state, chunk, false);
+        }
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.finished = true;
+        }
+        state.changed.notify_one();
+        state.worker.join();
+    }
+
+    // Must be called before the element at the given position of data_ is moved or destroyed.
+    // Complexity: O(1) guaranteed, if there is no background rehash whose worker may read it.
+    void ProtectFromPendingRehash(const size_t position) {
+        if (pending_rehash_.pending && position < pending_rehash_.pending->element_count) {
+            ClaimRehashChunk(*pending_rehash_.pending, position / kBackgroundRehashChunk, true);
+        }
+    }
+
+    // Logs change of data_ for the worker of background rehash in progress, if any.
+    // Complexity: O(1) amortized.
+    void LogRehashDelta(const RehashDelta& delta) {
+        if (!pending_rehash_.pending) {
+            return;
+        }
+        PendingRehash& pending = *pending_rehash_.pending;
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(pending.mutex);
+            pending.deltas.push_back(delta);
+            notify = pending.ready;
+            pending.ready = false;
+        }
+        if (notify) {
+            pending.changed.notify_one();
+        }
+    }
+
+    // Installs table of background rehash, if the worker has replayed all deltas:
+    // swaps it with hash_table_ (the worker frees the old table and is joined later,
+    // see PendingRehashHolder) and builds sorted indexes of its long buckets.
+    // Returns whether the table has been installed.
+    // Complexity: O(1) guaranteed plus MakeLongBucket for every long bucket.
+    bool TryInstallPendingRehash() {
+        PendingRehash& pending = *pending_rehash_.pending;
+        auto start = std::chrono::steady_clock::now();
+        size_t old_bucket_count = hash_table_.size();
+        {
+            std::lock_guard<std::mutex> lock(pending.mutex);
+            if (!pending.ready) {
+                return false;
+            }
+            hash_table_.swap(pending.table);
+            long_buckets_.swap(pending.long_buckets);
+            std::vector<size_t>& candidates = pending.long_bucket_candidates;
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                             candidates.end());
+            for (size_t bucket : candidates) {
+                if (hash_table_[bucket].size() > kTreeifyThreshold) {
+                    long_buckets_.push_back(MakeLongBucket(bucket, hash_table_[bucket],
+                                                           data_.data(), GetHasher()));
+                }
+            }
+            pending.finished = true;
+        }
+        pending.changed.notify_one();
+        pending_rehash_.installed = std::move(pending_rehash_.pending);
+        ++rehash_count_;
+        std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+        rehash_time_ += duration;
+        NotifyRehash(HashMapRehashEvent::Trigger::kGrow, old_bucket_count, duration, true);
+        return true;
+    }
+
+    // Must be called before computing bucket of an element to be appended to data_:
+    // if appending would reallocate data_ while the worker of background rehash may still
+    // read it, hashes the remaining keys first.
+    // Complexity: O(1) guaranteed, if there are no keys left to hash.
+    void PrepareAppend() {
+        if (pending_rehash_.pending && data_.size() == data_.capacity() &&
+            pending_rehash_.pending->hashed_chunks.load(std::memory_order_acquire) <
+                    pending_rehash_.pending->chunk_count) {
+            PendingRehash& pending = *pending_rehash_.pending;
+            for (size_t chunk = 0; chunk < pending.chunk_count; ++chunk) {
+                ClaimRehashChunk(pending, chunk, true);
+            }
+        }
+    }
+
+    // Returns # of buckets hash table should have according to resize policy
+    // (current # of buckets if no resize is necessary).
+    // Complexity: O(1) guaranteed.
+    size_t GetNewTableSize() const {
+        if (hash_table_.size() * kMaxLoadFactor < data_.size() ||
+            data_.size() * kMinLoadFactor < hash_table_.size()) {
+            return std::max(data_.size(), static_cast<size_t>(kMinLoad));
+        }
+        return hash_table_.size();
+    }
+
+    // Distributes indexes of all elements of data_ over buckets of the given empty table.
+    // Complexity: O(# of elements in hash map + |table|) average case.
+    void FillTable(std::vector<std::vector<size_t>>& table) const {
+        for (size_t ind = 0; ind < data_.size(); ++ind) {
+            table[GetHasher()(data_[ind].first) % table.size()].push_back(ind);
+        }
+    }
+
+    // Checks whether element stored at data_[data_index] has key == Key.
+    // Complexity: O(1) guaranteed (assuming key comparison is O(1)).
+    template<class Key>
+    bool KeyMatches(const size_t data_index, const Key& key) const {
+        HASHMAP_COUNT(kKeyComparisons, 1);
+        return GetKeyEqual()(data_[data_index].first, key);
+    }
+
+    // Number of threads worth using for count elements, but no more than requested.
+    // Complexity: O(1) guaranteed.
+    static size_t GetBuildThreads(const size_t requested_threads, const size_t count) {
+        return std::max<size_t>(1, std::min(requested_threads, count / kMinElementsPerThread));
+    }
+
+    // Splits [0, count) into num_threads contiguous ranges and calls
+    // function(thread_index, from, to) for every range in its own thread
+    // (the range of thread 0 is processed by the calling thread).
+    // Ranges depend only on count and num_threads, so consecutive calls with equal arguments
+    // give each thread the same range.
+    // Complexity: O(num_threads) guaranteed plus running time of the longest call.
+    template<class Function>
+    static void ParallelFor(const size_t num_threads, const size_t count, const Function& function) {
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads - 1);
+        for (size_t thread = 1; thread < num_threads; ++thread) {
+            threads.emplace_back(function, thread, count * thread / num_threads,
+                                 count * (thread + 1) / num_threads);
+        }
+        function(0, 0, count / num_threads);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Rebuilds hash table with table_size buckets for all elements of data_ with num_threads
+    // threads (see parallel constructor for the algorithm). If resolve_duplicates is set,
+    // elements with key equal to the key of some earlier element are removed from data_.
+    // Complexity: O(# of elements in hash map / num_threads) average case per thread.
+    void BuildTableParallel(const size_t table_size, const size_t num_threads,
+                            const bool resolve_duplicates) {
+        const size_t count = data_.size();
+        const size_t partitions = num_threads * kPartitionsPerThread;
+        const size_t partition_width = (table_size + partitions - 1) / partitions;
+        hash_table_.clear();
+        hash_table_.resize(table_size);
+
+        std::vector<size_t> buckets(count);
+        std::vector<size_t> offsets(num_threads * partitions);
+        ParallelFor(num_threads, count, [&](size_t thread, size_t from, size_t to) {
+            size_t* thread_offsets = &offsets[thread * partitions];
+            for (size_t ind = from; ind < to; ++ind) {
+                buckets[ind] = GetTableBucket(data_[ind].first);
+                ++thread_offsets[buckets[ind] / partition_width];
+            }
+        });
+
+        // Turn counts into starting positions: partition-major, then thread order.
+        std::vector<size_t> partition_begin(partitions + 1);
+        size_t position = 0;
+        for (size_t partition = 0; partition < partitions; ++partition) {
+            partition_begin[partition] = position;
+            for (size_t thread = 0; thread < num_threads; ++thread) {
+                size_t partial_count = offsets[thread * partitions + partition];
+                offsets[thread * partitions + partition] = position;
+                position += partial_count;
+            }
+        }
+        partition_begin[partitions] = position;
+
+        std::vector<size_t> order(count);
+        ParallelFor(num_threads, count, [&](size_t thread, size_t from, size_t to) {
+            size_t* thread_offsets = &offsets[thread * partitions];
+            for (size_t ind = from; ind < to; ++ind) {
+                order[thread_offsets[buckets[ind] / partition_width]++] = ind;
+            }
+        });
+
+        std::vector<char> is_duplicate(resolve_duplicates ? count : 0);
+        std::vector<char> has_duplicates(num_threads);
+        ParallelFor(num_threads, partitions, [&](size_t thread, size_t from, size_t to) {
+            for (size_t ind = partition_begin[from]; ind < partition_begin[to]; ++ind) {
+                size_t data_index = order[ind];
+                std::vector<size_t>& bucket = hash_table_[buckets[data_index]];
+                if (resolve_duplicates && FindInBucket(bucket, data_[data_index].first)) {
+                    is_duplicate[data_index] = has_duplicates[thread] = 1;
+                    continue;
+                }
+                bucket.push_back(data_index);
+            }
+        });
+
+        if (std::find(has_duplicates.begin(), has_duplicates.end(), 1) == has_duplicates.end()) {
+            return;
+        }
+        std::vector<size_t>& new_position = buckets;
+        size_t kept = 0;
+        for (size_t ind = 0; ind < count; ++ind) {
+            new_position[ind] = kept;
+            if (!is_duplicate[ind]) {
+                if (kept != ind) {
+                    data_[kept] = std::move(data_[ind]);
+                }
+                ++kept;
+            }
+        }
+        data_.erase(data_.begin() + kept, data_.end());
+        ParallelFor(num_threads, table_size, [&](size_t, size_t from, size_t to) {
+            for (size_t bucket = from; bucket < to; ++bucket) {
+                for (size_t& data_index : hash_table_[bucket]) {
+                    data_index = new_position[data_index];
+                }
+            }
+        });
+    }
+
+    // Checks whether given bucket contains element with key == Key.
+    // Complexity: O(1) average case.
+    template<class Key>
+    bool FindInBucket(const std::vector<size_t>& bucket, const Key& key) const {
+        for (size_t data_index : bucket) {
+            if (KeyMatches(data_index, key)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns index in data_ of the element with key == Key (data_.size() if there is none),
+    // when its hash and bucket are given.
+    // Complexity: O(1) average case; O(log(bucket length)) for a long bucket.
+    template<class Key>
+    size_t FindPosition(const size_t key_bucket, const size_t hash, const Key& key) const {
+        const std::vector<size_t>& bucket = hash_table_[key_bucket];
+        if (bucket.size() > kUntreeifyThreshold) {
+            const LongBucket* long_bucket = FindLongBucket(key_bucket);
+            if (long_bucket != nullptr) {
+                return FindInLongBucket(*long_bucket, hash, key);
+            }
+        }
+        for (size_t data_index : bucket) {
+            if (KeyMatches(data_index, key)) {
+                return data_index;
+            }
+        }
+        return data_.size();
+    }
+
+    // Finds iterator that has key == Key when bucket where element with key = Key is given.
+    // Complexity: O(1) average case.
+    template<class Key>
+    iterator FindByTableBucket(const size_t key_bucket, const size_t hash, const Key& key) {
+        return iterator(data_.begin() + FindPosition(key_bucket, hash, key));
+    }
+
+    // Finds iterator that has key == Key when bucket where element with key = Key is given.
+    // Complexity: O(1) average case.
+    template<class Key>
+    const_iterator FindByTableBucket(const size_t key_bucket, const size_t hash,
+                                     const Key& key) const {
+        return const_iterator(data_.cbegin() + FindPosition(key_bucket, hash, key));
+    }
+
+    // Complexity: O(1) average case.
+    template<class Key>
+    iterator FindByHash(const size_t hash, const Key& key) {
+        return HASHMAP_COUNT_LOOKUP(FindByTableBucket(GetTableBucketByHash(hash), hash, key),
+                                    end());
+    }
+
+    // Complexity: O(1) average case.
+    template<class Key>
+    const_iterator FindByHash(const size_t hash, const Key& key) const {
+        return HASHMAP_COUNT_LOOKUP(FindByTableBucket(GetTableBucketByHash(hash), hash, key),
+                                    end());
+    }
+
+    // Returns sorted index of the given bucket, nullptr if it has none.
+    // Complexity: O(log(# of long buckets)) guaranteed.
+    const LongBucket* FindLongBucket(const size_t bucket) const {
+        auto position = LowerBoundLongBucket(bucket);
+        if (position == long_buckets_.end() || position->bucket != bucket) {
+            return nullptr;
+        }
+        return &*position;
+    }
+
+    // Complexity: O(log(# of long buckets)) guaranteed.
+    typename std::vector<LongBucket>::const_iterator LowerBoundLongBucket(
+            const size_t bucket) const {
+        return std::lower_bound(long_buckets_.begin(), long_buckets_.end(), bucket,
+                                [](const LongBucket& long_bucket, const size_t other) {
+                                    return long_bucket.bucket < other;
+                                });
+    }
+
+    // Complexity: O(log(# of long buckets)) guaranteed.
+    typename std::vector<LongBucket>::iterator LowerBoundLongBucket(const size_t bucket) {
+        return std::lower_bound(long_buckets_.begin(), long_buckets_.end(), bucket,
+                                [](const LongBucket& long_bucket, const size_t other) {
+                                    return long_bucket.bucket < other;
+                                });
+    }
+
+    // Binary search of the key in the sorted index: elements with the same hash are searched
+    // by key if keys are ordered, and one by one otherwise.
+    // Complexity: O(log(bucket length) + # of elements with the same hash) guaranteed.
+    template<class Key>
+    size_t FindInLongBucket(const LongBucket& long_bucket, const size_t hash,
+                            const Key& key) const {
+        auto range = std::equal_range(long_bucket.entries.begin(), long_bucket.entries.end(),
+                                      LongBucketEntry(hash, 0),
+                                      [](const LongBucketEntry& first,
+                                         const LongBucketEntry& second) {
+                                          return first.first < second.first;
+                                      });
+        return FindInHashRun(range.first, range.second, key,
+                             std::integral_constant<bool, OrderedKeys::value &&
+                                                          std::is_same<Key, KeyType>::value>());
+    }
+
+    template<class Iter, class Key>
+    size_t FindInHashRun(Iter begin, Iter end, const Key& key, std::true_type) const {
+        Iter position = std::lower_bound(begin, end, key,
+                                         [this](const LongBucketEntry& entry, const Key& other) {
+                                             return data_[entry.second].first < other;
+                                         });
+        if (position != end && KeyMatches(position->second, key)) {
+            return position->second;
+        }
+        return data_.size();
+    }
+
+    template<class Iter, class Key>
+    size_t FindInHashRun(Iter begin, Iter end, const Key& key, std::false_type) const {
+        for (; begin != end; ++begin) {
+            if (KeyMatches(begin->second, key)) {
+                return begin->second;
+            }
+        }
+        return data_.size();
+    }
+
+    // Total # of key equality checks made by successful lookups of all elements of a long
+    // bucket: one per element if keys are ordered, otherwise position in its run of equal
+    // hashes.
+    // Complexity: O(bucket length) guaranteed.
+    static size_t CountLongBucketComparisons(const LongBucket& long_bucket) {
+        const std::vector<LongBucketEntry>& entries = long_bucket.entries;
+        if (OrderedKeys::value) {
+            return entries.size();
+        }
+        size_t comparisons = 0;
+        size_t run_length = 0;
+        for (size_t ind = 0; ind < entries.size(); ++ind) {
+            run_length = ind > 0 && entries[ind].first == entries[ind - 1].first ?
+                         run_length + 1 : 1;
+            comparisons += run_length;
+        }
+        return comparisons;
+    }
+
+    // Orders entries of LongBucket by hash, then by key (if keys are ordered).
+    // Complexity: O(1) guaranteed (assuming key comparison is O(1)).
+    static bool LongBucketEntryLess(const KeyValuePair* data, const LongBucketEntry& first,
+                                    const LongBucketEntry& second) {
+        if (first.first != second.first) {
+            return first.first < second.first;
+        }
+        return KeyLess(data[first.second].first, data[second.second].first, OrderedKeys());
+    }
+
+    static bool KeyLess(const KeyType& first, const KeyType& second, std::true_type) {
+        return first < second;
+    }
+
+    static bool KeyLess(const KeyType&, const KeyType&, std::false_type) {
+        return false;
+    }
+
+    // Builds sorted index of the given bucket of a hash table for elements of data.
+    // Complexity: O(k log k) guaranteed for a bucket of k elements, plus k hash computations.
+    static LongBucket MakeLongBucket(const size_t bucket, const std::vector<size_t>& chain,
+                                     const KeyValuePair* data, const Hash& hasher) {
+        LongBucket long_bucket{bucket, {}};
+        long_bucket.entries.reserve(chain.size());
+        for (size_t data_index : chain) {
+            long_bucket.entries.emplace_back(hasher(data[data_index].first), data_index);
+        }
+        std::sort(long_bucket.entries.begin(), long_bucket.entries.end(),
+                  [data](const LongBucketEntry& first, const LongBucketEntry& second) {
+                      return LongBucketEntryLess(data, first, second);
+                  });
+        return long_bucket;
+    }
+
+    // Builds sorted indexes of all buckets of table longer than kTreeifyThreshold.
+    // Static, as it is also used by background rehash.
+    // Complexity: O(|table|) guaranteed plus MakeLongBucket for every long bucket.
+    static std::vector<LongBucket> BuildLongBuckets(const std::vector<std::vector<size_t>>& table,
+                                                    const KeyValuePair* data, const Hash& hasher) {
+        std::vector<LongBucket> long_buckets;
+        for (size_t bucket = 0; bucket < table.size(); ++bucket) {
+            if (table[bucket].size() > kTreeifyThreshold) {
+                long_buckets.push_back(MakeLongBucket(bucket, table[bucket], data, hasher));
+            }
+        }
+        return long_buckets;
+    }
+
+    // Must be called after every rebuild of hash_table_.
+    // Complexity: O(|hash_table|) guaranteed plus MakeLongBucket for every long bucket.
+    void RebuildLongBuckets() {
+        long_buckets_ = BuildLongBuckets(hash_table_, data_.data(), GetHasher());
+    }
+
+    // Must be called after index of an element with the given hash has been appended to the
+    // bucket: adds it to the sorted index of the bucket, creating the index if the bucket
+    // has just become long.
+    // Complexity: O(1) guaranteed for a short bucket; O(bucket length) otherwise.
+    void AddToLongBucket(const size_t bucket, const size_t hash, const size_t data_index) {
+        if (hash_table_[bucket].size() <= kUntreeifyThreshold) {
+            return;
+        }
+        auto position = LowerBoundLongBucket(bucket);
+        if (position != long_buckets_.end() && position->bucket == bucket) {
+            const KeyValuePair* data = data_.data();
+            LongBucketEntry entry(hash, data_index);
+            std::vector<LongBucketEntry>& entries = position->entries;
+            entries.insert(std::upper_bound(entries.begin(), entries.end(), entry,
+                                            [data](const LongBucketEntry& first,
+                                                   const LongBucketEntry& second) {
+                                                return LongBucketEntryLess(data, first, second);
+                                            }),
+                           entry);
+        } else if (hash_table_[bucket].size() > kTreeifyThreshold) {
+            long_buckets_.insert(position, MakeLongBucket(bucket, hash_table_[bucket],
+                                                          data_.data(), GetHasher()));
+        }
+    }
+
+    // Must be called after index of an element with the given hash has been removed from the
+    // bucket: removes it from the sorted index of the bucket, dropping the index if the bucket
+    // has become short.
+    // Complexity: O(1) guaranteed if there are no long buckets; O(bucket length) otherwise.
+    void RemoveFromLongBucket(const size_t bucket, const size_t hash, const size_t data_index) {
+        if (long_buckets_.empty()) {
+            return;
+        }
+        auto position = LowerBoundLongBucket(bucket);
+        if (position == long_buckets_.end() || position->bucket != bucket) {
+            return;
+        }
+        if (hash_table_[bucket].size() <= kUntreeifyThreshold) {
+            long_buckets_.erase(position);
+            return;
+        }
+        std::vector<LongBucketEntry>& entries = position->entries;
+        entries.erase(std::find(entries.begin(), entries.end(),
+                                LongBucketEntry(hash, data_index)));
+    }
+
+    // Must be called after element with the given hash has been moved in data_
+    // from old_index to new_index.
+    // Complexity: O(1) guaranteed if there are no long buckets; O(bucket length) otherwise.
+    void RenumberInLongBucket(const size_t bucket, const size_t hash, const size_t old_index,
+                              const size_t new_index) {
+        if (long_buckets_.empty()) {
+            return;
+        }
+        auto position = LowerBoundLongBucket(bucket);
+        if (position == long_buckets_.end() || position->bucket != bucket) {
+            return;
+        }
+        std::vector<LongBucketEntry>& entries = position->entries;
+        std::find(entries.begin(), entries.end(), LongBucketEntry(hash, old_index))->second =
+                new_index;
+    }
+
+    // Performs one stage of the lookup described by state; the same traversal as
+    // FindByTableBucket, split at every point where we would wait for memory.
+    // Returns true if the lookup is finished (its result is written to positions).
+    // Complexity: O(1) guaranteed.
+    bool AdvanceLookup(LookupState& state, const std::vector<KeyType>& keys,
+                       const std::vector<size_t>& hashes,
+                       std::vector<size_t>& positions) const {
+        switch (state.stage) {
+            case LookupStage::kHashBucket:
+                state.bucket = GetTableBucketByHash(hashes[state.key_index]);
+                HASHMAP_PREFETCH(&hash_table_[state.bucket]);
+                state.stage = LookupStage::kLoadChain;
+                return false;
+            case LookupStage::kLoadChain:
+                if (hash_table_[state.bucket].empty()) {
+                    return true;
+                }
+                HASHMAP_PREFETCH(hash_table_[state.bucket].data());
+                state.chain_position = 0;
+                state.stage = LookupStage::kLoadSlot;
+                return false;
+            case LookupStage::kLoadSlot:
+                HASHMAP_PREFETCH(&data_[hash_table_[state.bucket][state.chain_position]]);
+                state.stage = LookupStage::kCompareSlot;
+                return false;
+            case LookupStage::kCompareSlot: {
+                const std::vector<size_t>& chain = hash_table_[state.bucket];
+                size_t data_index = chain[state.chain_position];
+                if (KeyMatches(data_index, keys[state.key_index])) {
+                    positions[state.key_index] = data_index;
+                    return true;
+                }
+                if (++state.chain_position == chain.size()) {
+                    return true;
+                }
+                HASHMAP_PREFETCH(&data_[chain[state.chain_position]]);
+                return false;
+            }
+            case LookupStage::kDone:
+                break;
+        }
+        return true;
+    }
+
+    // Returns positions in data_ of all given keys (data_.size() if key is absent).
+    // All keys are hashed upfront (with HashBatch if hash function provides it).
+    // Keeps up to kLookupGroupSize lookups in flight, advancing them in round-robin order;
+    // finished lookup is immediately replaced with the next pending key.
+    // Complexity: O(# of keys) average case.
+    std::vector<size_t> FindBatchPositions(const std::vector<KeyType>& keys) const {
+        std::vector<size_t> positions(keys.size(), data_.size());
+        std::vector<size_t> hashes(keys.size());
+        HashKeys(GetHasher(), keys, hashes, 0);
+        LookupState group[kLookupGroupSize];
+        size_t next_key = 0;
+        size_t in_flight = 0;
+        for (LookupState& state : group) {
+            if (next_key < keys.size()) {
+                state = {next_key++, 0, 0, LookupStage::kHashBucket};
+                ++in_flight;
+            } else {
+                state.stage = LookupStage::kDone;
+            }
+        }
+        while (in_flight > 0) {
+            for (LookupState& state : group) {
+                if (state.stage == LookupStage::kDone ||
+                    !AdvanceLookup(state, keys, hashes, positions)) {
+                    continue;
+                }
+                if (next_key < keys.size()) {
+                    state = {next_key++, 0, 0, LookupStage::kHashBucket};
+                } else {
+                    state.stage = LookupStage::kDone;
+                    --in_flight;
+                }
+            }
+        }
+#ifdef HASHMAP_ENABLE_COUNTERS
+        for (size_t position : positions) {
+            HASHMAP_COUNT(kFindHits, position != data_.size());
+            HASHMAP_COUNT(kFindMisses, position == data_.size());
+        }
+#endif
+        return positions;
+    }
+
+  private:
+    PendingRehashHolder pending_rehash_;
+    std::vector<std::vector<size_t>> hash_table_;
+    std::vector<KeyValuePair> data_;
+    size_t rehash_threads_ = 1;
+    // Placed beside other small members: stateless functions take a single byte of padding.
+    Functions functions_;
+    bool background_rehash_ = false;
+    size_t reseed_count_ = 0;
+    // Resizes (by resize policy or rehash) and time spent rebuilding hash table (see stats).
+    size_t rehash_count_ = 0;
+    std::chrono::nanoseconds rehash_time_{0};
+    // Sorted indexes of buckets longer than kTreeifyThreshold, ordered by bucket.
+    std::vector<LongBucket> long_buckets_;
+    // Size of hash table when hash function was reseeded last time (see Reseed).
+    size_t last_reseed_table_size_ = 0;
+    std::function<void(const HashMapRehashEvent&)> rehash_callback_;
+};
+
+// HashMap with FastHash as hash function; pass std::equal_to<> as KeyEqual to enable
+// lookup of std::string keys by std::string_view.
+template<class KeyType, class ValueType, class KeyEqual = std::equal_to<KeyType>>
+using FastHashMap = HashMap<KeyType, ValueType, FastHash<KeyType>, KeyEqual>;
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/*
+ * Hot-path counters of HashMap, compiled in only if HASHMAP_ENABLE_COUNTERS is defined
+ * before hashtable.h is included. Otherwise HASHMAP_COUNT expands to nothing (its amount
+ * is not evaluated) and HASHMAP_COUNT_LOOKUP to the lookup result, so code of the hash map
+ * is the same as without instrumentation.
+ * Every thread counts into its own slots: a relaxed load and store, no atomic
+ * read-modify-write and no shared cache lines. Counters of all hash maps in the process
+ * are summed up on demand by HashMapCounters::Collect, counts of finished threads are kept.
+ */
+#ifdef HASHMAP_ENABLE_COUNTERS
+#define HASHMAP_COUNT(counter, amount) \
+    HashMapCounters::Add(HashMapCounters::Counter::counter, (amount))
+// Counts lookup hit or miss and evaluates to its result.
+#define HASHMAP_COUNT_LOOKUP(result, end) HashMapCounters::CountLookup((result), (end))
+#else
+#define HASHMAP_COUNT(counter, amount) ((void)0)
+#define HASHMAP_COUNT_LOOKUP(result, end) (result)
+#endif
+
+struct HashMapCounters {
+    enum class Counter : size_t {
+        kFindHits,
+        kFindMisses,
+        // Calls of key equality, by lookups as well as by insertions and erasures.
+        kKeyComparisons,
+        kInserts,
+        kErases,
+        kGrowRehashes,
+        kShrinkRehashes,
+        // Size of elements relocated to fill the hole left by an erased element.
+        kEraseBytesMoved,
+        kCount
+    };
+
+    size_t find_hits = 0;
+    size_t find_misses = 0;
+    size_t key_comparisons = 0;
+    size_t inserts = 0;
+    size_t erases = 0;
+    size_t grow_rehashes = 0;
+    size_t shrink_rehashes = 0;
+    size_t erase_bytes_moved = 0;
+
+    // Complexity: O(1) guaranteed (except for the first call in a thread).
+    static void Add(const Counter counter, const size_t amount) {
+        std::atomic<size_t>& value = GetThreadCounters().values[static_cast<size_t>(counter)];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    // Complexity: O(1) guaranteed (except for the first call in a thread).
+    template<class Iterator>
+    static Iterator CountLookup(Iterator result, const Iterator& end) {
+        Add(Counter::kFindHits, result != end);
+        Add(Counter::kFindMisses, result == end);
+        return result;
+    }
+
+    // Sums counters of all threads, including finished ones. Counts made concurrently
+    // with the call may be missed.
+    // Complexity: O(# of live threads that have counted) guaranteed.
+    static HashMapCounters Collect() {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        Values total = registry.finished;
+        for (const ThreadCounters* counters : registry.threads) {
+            for (size_t ind = 0; ind < kCounterCount; ++ind) {
+                total[ind] += counters->values[ind].load(std::memory_order_relaxed);
+            }
+        }
+        HashMapCounters result;
+        result.find_hits = total[static_cast<size_t>(Counter::kFindHits)];
+        result.find_misses = total[static_cast<size_t>(Counter::kFindMisses)];
+        result.key_comparisons = total[static_cast<size_t>(Counter::kKeyComparisons)];
+        result.inserts = total[static_cast<size_t>(Counter::kInserts)];
+        result.erases = total[static_cast<size_t>(Counter::kErases)];
+        result.grow_rehashes = total[static_cast<size_t>(Counter::kGrowRehashes)];
+        result.shrink_rehashes = total[static_cast<size_t>(Counter::kShrinkRehashes)];
+        result.erase_bytes_moved = total[static_cast<size_t>(Counter::kEraseBytesMoved)];
+        return result;
+    }
+
+    // Sets counters of all threads to zero. Counts made concurrently with the call
+    // may survive it.
+    // Complexity: O(# of live threads that have counted) guaranteed.
+    static void Reset() {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.finished = Values();
+        for (ThreadCounters* counters : registry.threads) {
+            for (std::atomic<size_t>& value : counters->values) {
+                value.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+  private:
+    constexpr static size_t kCounterCount = static_cast<size_t>(Counter::kCount);
+
+    struct Values {
+        size_t& operator[](const size_t index) {
+            return values[index];
+        }
+
+        size_t values[kCounterCount] = {};
+    };
+
+    struct ThreadCounters;
+
+    // Counters of live threads and sums of counters of finished ones.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadCounters*> threads;
+        Values finished;
+    };
+
+    // Registers itself on creation; on thread exit adds its counts to the finished ones.
+    struct alignas(64) ThreadCounters {
+        ThreadCounters() {
+            for (std::atomic<size_t>& value : values) {
+                value.store(0, std::memory_order_relaxed);
+            }
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(this);
+        }
+
+        ~ThreadCounters() {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (size_t ind = 0; ind < kCounterCount; ++ind) {
+                registry.finished[ind] += values[ind].load(std::memory_order_relaxed);
+            }
+            for (size_t ind = 0; ind < registry.threads.size(); ++ind) {
+                if (registry.threads[ind] == this) {
+                    registry.threads[ind] = registry.threads.back();
+                    registry.threads.pop_back();
+                    break;
+                }
+            }
+        }
+
+        std::atomic<size_t> values[kCounterCount];
+    };
+
+  private:
+    // Never destroyed: threads may finish after destruction of static objects.
+    static Registry& GetRegistry() {
+        static Registry* registry = new Registry();
+        return *registry;
+    }
+
+    static ThreadCounters& GetThreadCounters() {
+        thread_local ThreadCounters counters;
+        return counters;
+    }
+};
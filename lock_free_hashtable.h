@@ -0,0 +1,346 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "epoch_reclamation.h"
+#include "hash.h"
+
+/*
+ * Lock-free hash map for integral keys and values (e.g. shared counters) based on open
+ * addressing with linear probing over a power-of-two array of atomic (key, value) slots.
+ * Key of a slot is set once with compare-and-swap and never changes; values are updated
+ * with compare-and-swap, so insert, find and fetch_add never lock and never wait for
+ * another thread, resize included.
+ * One key is reserved: kEmptyKey marks a free slot. Values must lie in [0, kMaxValue]:
+ * the highest bit of a stored value marks a frozen slot, and the largest value without it
+ * (kEmptyValue) marks a slot whose key is claimed, but whose value is not set yet.
+ * Resize is cooperative: when a table becomes half full, a table of twice the capacity is
+ * attached to it, and every thread that notices this helps to copy the slots. A slot is
+ * copied in idempotent steps: its value is frozen by setting the highest bit (updates that
+ * come later fail and retry in the new table, while the value stays readable), the value is
+ * put under the same key into the new table unless some thread already did it, and the slot
+ * is marked moved. Any thread can finish the copy of any slot, so a thread first copies
+ * chunks of kMigrationChunk slots nobody has taken, then, instead of waiting for the chunks
+ * taken by others, copies the slots of them that are not moved yet. The new table is used
+ * once all slots of the old one are moved, and a preempted thread delays nobody.
+ * Every operation pins an EpochDomain, so old tables are retired to it once the current
+ * table pointer moves past them, and freed when no operation can be using them.
+ * The domain has reader_slots slots; operations of threads beyond that many still proceed,
+ * but pin through a shared counter and delay freeing of old tables (see EpochDomain).
+ * Elements can't be erased.
+ */
+template<class KeyType, class ValueType, class Hash = IntegerHash<KeyType>>
+class LockFreeHashMap {
+    static_assert(std::is_integral<KeyType>::value && std::is_integral<ValueType>::value,
+                  "LockFreeHashMap supports only integral keys and values.");
+
+    // Values are stored as unsigned, so that the highest bit is free for the frozen mark.
+    using StoredValue = typename std::make_unsigned<ValueType>::type;
+
+    constexpr static StoredValue kEmptyValue = static_cast<StoredValue>(~StoredValue(0)) >> 1;
+    constexpr static StoredValue kFrozenBit = static_cast<StoredValue>(kEmptyValue + 1);
+    // Frozen kEmptyValue: the slot is copied to the next table, or it had no value to copy.
+    constexpr static StoredValue kMovedValue = static_cast<StoredValue>(~StoredValue(0));
+
+  public:
+    constexpr static KeyType kEmptyKey = std::numeric_limits<KeyType>::max();
+    constexpr static ValueType kMaxValue = static_cast<ValueType>(kEmptyValue - 1);
+    constexpr static size_t kMinCapacity = 16;
+    constexpr static size_t kMigrationChunk = 1024;
+
+  public:
+    // Complexity: O(capacity + reader_slots) guaranteed.
+    explicit LockFreeHashMap(size_t capacity = kMinCapacity, const Hash& hasher_ = Hash(),
+                             const size_t reader_slots = EpochDomain::kDefaultSlotCount) :
+            reclamation_(reader_slots), hasher_(hasher_) {
+        size_t table_capacity = kMinCapacity;
+        while (table_capacity < 2 * capacity) {
+            table_capacity *= 2;
+        }
+        current_.store(new Table(table_capacity), std::memory_order_relaxed);
+    }
+
+    LockFreeHashMap(const LockFreeHashMap&) = delete;
+    LockFreeHashMap& operator=(const LockFreeHashMap&) = delete;
+
+    // Complexity: O(capacity) guaranteed.
+    ~LockFreeHashMap() {
+        Table* table = current_.load(std::memory_order_relaxed);
+        while (table != nullptr) {
+            Table* next = table->next.load(std::memory_order_relaxed);
+            delete table;
+            table = next;
+        }
+    }
+
+    // Returns value of the element with key == Key, if it exists.
+    // Complexity: O(1) average case.
+    std::optional<ValueType> find(const KeyType key) const {
+        CheckKey(key);
+        EpochDomain::Guard guard(reclamation_);
+        while (true) {
+            Table* table = GetTable();
+            size_t mask = table->capacity - 1;
+            size_t position = hasher_(key) & mask;
+            bool retry = false;
+            for (size_t probe = 0; probe < table->capacity && !retry;
+                 ++probe, position = (position + 1) & mask) {
+                Slot& slot = table->slots[position];
+                KeyType slot_key = slot.key.load(std::memory_order_acquire);
+                if (slot_key != key && slot_key != kEmptyKey) {
+                    continue;
+                }
+                StoredValue value = slot.value.load(std::memory_order_acquire);
+                if (IsFrozen(value)) {
+                    retry = true;
+                    continue;
+                }
+                if (slot_key == kEmptyKey || value == kEmptyValue) {
+                    return std::nullopt;
+                }
+                return static_cast<ValueType>(value);
+            }
+            if (!retry) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    // Inserts element if its key is not present yet; returns whether it was inserted.
+    // Complexity: O(1) amortized average case.
+    bool insert(const KeyType key, const ValueType value) {
+        CheckKey(key);
+        CheckValue(value);
+        EpochDomain::Guard guard(reclamation_);
+        while (true) {
+            Table* table = GetTable();
+            Slot* slot = ClaimSlot(*table, key);
+            if (slot == nullptr) {
+                continue;
+            }
+            StoredValue expected = kEmptyValue;
+            if (slot->value.compare_exchange_strong(expected, static_cast<StoredValue>(value),
+                                                    std::memory_order_acq_rel)) {
+                return true;
+            }
+            if (!IsFrozen(expected)) {
+                return false;
+            }
+        }
+    }
+
+    // Adds delta to the value of the element with key == Key (inserting it with value delta
+    // if necessary) and returns the previous value (0 if the element didn't exist).
+    // The resulting value must lie in [0, kMaxValue].
+    // Complexity: O(1) amortized average case.
+    ValueType fetch_add(const KeyType key, const ValueType delta) {
+        CheckKey(key);
+        EpochDomain::Guard guard(reclamation_);
+        while (true) {
+            Table* table = GetTable();
+            Slot* slot = ClaimSlot(*table, key);
+            if (slot == nullptr) {
+                continue;
+            }
+            StoredValue value = slot->value.load(std::memory_order_acquire);
+            while (!IsFrozen(value)) {
+                ValueType old_value = (value == kEmptyValue) ? 0 : static_cast<ValueType>(value);
+                ValueType new_value = (value == kEmptyValue) ? delta : old_value + delta;
+                CheckValue(new_value);
+                if (slot->value.compare_exchange_weak(value, static_cast<StoredValue>(new_value),
+                                                      std::memory_order_acq_rel)) {
+                    return old_value;
+                }
+            }
+        }
+    }
+
+    // Number of claimed slots in the current table: under concurrent insertions it is
+    // approximate, and it may include keys whose insertion is still in progress.
+    // Complexity: O(1) guaranteed.
+    size_t size() const {
+        EpochDomain::Guard guard(reclamation_);
+        return GetTable()->size.load(std::memory_order_relaxed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    size_t capacity() const {
+        EpochDomain::Guard guard(reclamation_);
+        return GetTable()->capacity;
+    }
+
+  private:
+    struct Slot {
+        std::atomic<KeyType> key{kEmptyKey};
+        std::atomic<StoredValue> value{kEmptyValue};
+    };
+
+    struct Table {
+        explicit Table(size_t capacity) : capacity(capacity), slots(new Slot[capacity]) {}
+
+        const size_t capacity;
+        const std::unique_ptr<Slot[]> slots;
+        std::atomic<size_t> size{0};
+        std::atomic<Table*> next{nullptr};
+        std::atomic<size_t> next_chunk{0};
+        // # of slots marked moved; the table is migrated when it reaches capacity.
+        std::atomic<size_t> moved_slots{0};
+    };
+
+  private:
+    // Complexity: O(1) guaranteed.
+    static void CheckKey(const KeyType key) {
+        if (key == kEmptyKey) {
+            throw std::invalid_argument("LockFreeHashMap key is reserved.");
+        }
+    }
+
+    // Complexity: O(1) guaranteed.
+    static void CheckValue(const ValueType value) {
+        // Negative values become larger than kMaxValue.
+        if (static_cast<StoredValue>(value) > static_cast<StoredValue>(kMaxValue)) {
+            throw std::invalid_argument("LockFreeHashMap value is out of range.");
+        }
+    }
+
+    // Complexity: O(1) guaranteed.
+    static bool IsFrozen(const StoredValue value) {
+        return (value & kFrozenBit) != 0;
+    }
+
+    // Returns table all operations should work with: if a migration is in progress,
+    // finishes it first, together with the threads that are already copying it.
+    // The thread that moves current table pointer retires the old table. Must be called with the domain pinned.
+    // Complexity: O(1) guaranteed if there is no migration; otherwise O(capacity).
+    Table* GetTable() const {
+        Table* table = current_.load(std::memory_order_acquire);
+        Table* next = table->next.load(std::memory_order_acquire);
+        while (next != nullptr) {
+            HelpMigrate(*table, *next);
+            Table* expected = table;
+            if (current_.compare_exchange_strong(expected, next, std::memory_order_acq_rel)) {
+                reclamation_.retire(std::shared_ptr<void>(std::unique_ptr<Table>(table)));
+            }
+            table = current_.load(std::memory_order_acquire);
+            next = table->next.load(std::memory_order_acquire);
+        }
+        return table;
+    }
+
+    // Returns slot with key == Key, claiming a free one if there is no such slot.
+    // Returns nullptr if the table is too full; then migration to a larger table is started.
+    // Complexity: O(1) average case.
+    Slot* ClaimSlot(Table& table, const KeyType key) {
+        if (2 * table.size.load(std::memory_order_relaxed) >= table.capacity) {
+            StartMigration(table);
+            return nullptr;
+        }
+        Slot* slot = ProbeSlot(table, key);
+        if (slot == nullptr) {
+            StartMigration(table);
+        }
+        return slot;
+    }
+
+    // Returns slot with key == Key, claiming a free one if there is no such slot.
+    // Returns nullptr if all slots are taken by other keys.
+    // Complexity: O(1) average case.
+    Slot* ProbeSlot(Table& table, const KeyType key) const {
+        size_t mask = table.capacity - 1;
+        size_t position = hasher_(key) & mask;
+        for (size_t probe = 0; probe < table.capacity; ++probe, position = (position + 1) & mask) {
+            Slot& slot = table.slots[position];
+            KeyType slot_key = slot.key.load(std::memory_order_acquire);
+            if (slot_key == kEmptyKey) {
+                if (slot.key.compare_exchange_strong(slot_key, key, std::memory_order_acq_rel)) {
+                    table.size.fetch_add(1, std::memory_order_relaxed);
+                    return &slot;
+                }
+            }
+            if (slot_key == key) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // Attaches a table of twice the capacity to the given one, unless it is already done.
+    // Complexity: O(capacity) guaranteed.
+    void StartMigration(Table& table) {
+        if (table.next.load(std::memory_order_acquire) != nullptr) {
+            return;
+        }
+        Table* next = new Table(2 * table.capacity);
+        Table* expected = nullptr;
+        if (!table.next.compare_exchange_strong(expected, next, std::memory_order_acq_rel)) {
+            delete next;
+        }
+    }
+
+    // Copies chunks of table nobody has taken yet to next; then, instead of waiting for
+    // the chunks taken by other threads, copies their slots that are not moved yet.
+    // All slots of table are moved when it returns.
+    // Complexity: O(capacity) guaranteed.
+    void HelpMigrate(Table& table, Table& next) const {
+        size_t chunks = (table.capacity + kMigrationChunk - 1) / kMigrationChunk;
+        size_t chunk;
+        while ((chunk = table.next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+            MigrateSlots(table, next, chunk * kMigrationChunk,
+                         std::min(table.capacity, (chunk + 1) * kMigrationChunk));
+        }
+        if (table.moved_slots.load(std::memory_order_acquire) < table.capacity) {
+            MigrateSlots(table, next, 0, table.capacity);
+        }
+    }
+
+    // Copies slots [begin, end) of table to next and counts the ones this thread marked moved.
+    // Complexity: O(end - begin) average case.
+    void MigrateSlots(Table& table, Table& next, const size_t begin, const size_t end) const {
+        size_t moved = 0;
+        for (size_t position = begin; position < end; ++position) {
+            moved += MigrateSlot(table.slots[position], next);
+        }
+        if (moved > 0) {
+            table.moved_slots.fetch_add(moved, std::memory_order_acq_rel);
+        }
+    }
+
+    // Copies slot to next: freezes its value, puts the value under the same key into next
+    // unless another thread already did it, and marks the slot moved. Every step may be
+    // repeated by other threads that copy the same slot, so no thread waits for another.
+    // Nothing else writes values to next before all slots are moved, so the first value put
+    // there is the frozen one. Returns whether this call marked the slot moved.
+    // Complexity: O(1) average case.
+    bool MigrateSlot(Slot& slot, Table& next) const {
+        StoredValue value = slot.value.load(std::memory_order_acquire);
+        while (!IsFrozen(value)) {
+            StoredValue frozen = static_cast<StoredValue>(value | kFrozenBit);
+            if (slot.value.compare_exchange_weak(value, frozen, std::memory_order_acq_rel)) {
+                if (frozen == kMovedValue) {
+                    return true;
+                }
+                value = frozen;
+            }
+        }
+        if (value == kMovedValue) {
+            return false;
+        }
+        // Next table has twice the capacity, so it always has a slot for the key.
+        Slot* target = ProbeSlot(next, slot.key.load(std::memory_order_acquire));
+        StoredValue expected = kEmptyValue;
+        StoredValue thawed = static_cast<StoredValue>(value & ~kFrozenBit);
+        target->value.compare_exchange_strong(expected, thawed, std::memory_order_acq_rel);
+        return slot.value.compare_exchange_strong(value, kMovedValue, std::memory_order_acq_rel);
+    }
+
+  private:
+    mutable std::atomic<Table*> current_;
+    mutable EpochDomain reclamation_;
+    Hash hasher_;
+};
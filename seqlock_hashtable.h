@@ -0,0 +1,419 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "epoch_reclamation.h"
+#include "hashtable.h"
+
+/*
+ * Hash map for one writer thread and many reader threads, built around a sequence lock.
+ * The writer keeps the elements in an ordinary HashMap (used for its own lookups, resize
+ * policy and long-bucket index) and mirrors them into a reader table of the same shape:
+ * buckets of element indexes and an array of elements, where every word readers load
+ * (pointers, sizes, indexes, words of keys and values) is a std::atomic.
+ * Every modification of the reader table is surrounded by two increments of sequence_
+ * (odd value means that write is in progress). Readers never lock and never perform atomic
+ * read-modify-write: they load everything with acquire loads and check sequence_ again
+ * before using what they have read, retrying the lookup if a write happened meanwhile.
+ * The writer stores every word with a release store after the first increment, so a reader
+ * that has loaded any word of a write also sees that increment. No read is a data race,
+ * and no standalone fence is involved, so ThreadSanitizer checks the whole protocol.
+ * Arrays that would be freed by a write (elements or a bucket growing beyond its capacity,
+ * the whole table on resize) are instead swapped out and retired to an EpochDomain,
+ * which frees them once every reader that might still be traversing them has finished.
+ * The domain has reader_slots slots: up to that many threads read with a plain store to
+ * their own slot, the rest share an atomic counter and delay freeing of retired arrays
+ * while they read (see EpochDomain). Readers are never refused.
+ * Keys and values must be trivially copyable: they are stored in the reader table as
+ * their object representation, copied word by word. The mirror roughly doubles memory
+ * used by elements and indexes compared to a plain HashMap.
+ */
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+         class KeyEqual = std::equal_to<KeyType>>
+class SeqlockHashMap {
+    static_assert(std::is_trivially_copyable<KeyType>::value &&
+                  std::is_trivially_copyable<ValueType>::value,
+                  "SeqlockHashMap requires trivially copyable keys and values.");
+
+  public:
+    using Map = HashMap<KeyType, ValueType, Hash, KeyEqual>;
+    using KeyValuePair = typename Map::KeyValuePair;
+
+  public:
+    // Complexity: O(reader_slots) guaranteed.
+    explicit SeqlockHashMap(const Hash& hasher_ = Hash(),
+                            const KeyEqual& key_equal_ = KeyEqual(),
+                            const size_t reader_slots = EpochDomain::kDefaultSlotCount) :
+            map_(hasher_, key_equal_), reclamation_(reader_slots) {
+        table_.store(BuildTable(), std::memory_order_relaxed);
+    }
+
+    SeqlockHashMap(const SeqlockHashMap&) = delete;
+    SeqlockHashMap& operator=(const SeqlockHashMap&) = delete;
+
+    // Complexity: O(|hash_table|) guaranteed.
+    ~SeqlockHashMap() {
+        delete table_.load(std::memory_order_relaxed);
+        delete[] data_.load(std::memory_order_relaxed);
+    }
+
+    // Returns copy of the value with key == Key if it exists. May be called from any thread.
+    // Complexity: O(1) average case, if there are no concurrent writes.
+    std::optional<ValueType> find(const KeyType& key) const {
+        const size_t hash = map_.GetHasher()(key);
+        EpochDomain::Guard guard(reclamation_);
+        while (true) {
+            uint64_t sequence = sequence_.load(std::memory_order_acquire);
+            if (sequence & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::optional<ValueType> result;
+            if (OptimisticFind(key, hash, sequence, result)) {
+                return result;
+            }
+        }
+    }
+
+    // May be called from any thread.
+    // Complexity: O(1) average case, if there are no concurrent writes.
+    bool contains(const KeyType& key) const {
+        return find(key).has_value();
+    }
+
+    // Inserts element if its key is not present yet; returns whether it was inserted.
+    // Writer thread only.
+    // Complexity: O(1) amortized average case.
+    bool insert(const KeyValuePair& element) {
+        size_t hash = map_.GetHasher()(element.first);
+        size_t bucket = map_.GetTableBucketByHash(hash);
+        if (map_.FindByTableBucket(bucket, hash, element.first) != map_.end()) {
+            return false;
+        }
+        size_t position = map_.data_.size();
+        map_.hash_table_[bucket].push_back(position);
+        map_.data_.push_back(element);
+        ReserveData(position + 1);
+        ReserveBucket(bucket, map_.hash_table_[bucket].size());
+        BeginWrite();
+        StoreElement(position, element);
+        StoreBucket(bucket);
+        data_size_.store(position + 1, std::memory_order_release);
+        EndWrite();
+        // Sorted indexes of long buckets are used only by the writer.
+        map_.AddToLongBucket(bucket, hash, position);
+        RehashIfNecessary();
+        return true;
+    }
+
+    // Sets value of the element with key == Key, inserting it if necessary.
+    // Writer thread only.
+    // Complexity: O(1) amortized average case.
+    void insert_or_assign(const KeyType& key, const ValueType& value) {
+        auto key_iterator = map_.find(key);
+        if (key_iterator == map_.end()) {
+            insert({key, value});
+            return;
+        }
+        key_iterator->second = value;
+        Word* element = data_.load(std::memory_order_relaxed) +
+                        map_.GetDataPosition(key_iterator) * kElementWords;
+        BeginWrite();
+        StoreWords(element + kKeyWords, value);
+        EndWrite();
+    }
+
+    // Removes element with key == Key; returns whether it existed. Writer thread only.
+    // Complexity: O(1) amortized average case.
+    bool erase(const KeyType& key) {
+        size_t hash = map_.GetHasher()(key);
+        size_t bucket = map_.GetTableBucketByHash(hash);
+        auto key_iterator = map_.FindByTableBucket(bucket, hash, key);
+        if (key_iterator == map_.end()) {
+            return false;
+        }
+        // HashMap moves the last element into the place of the erased one and renumbers it
+        // in its bucket, so that bucket and that place change as well.
+        size_t position = map_.GetDataPosition(key_iterator);
+        size_t last_bucket = map_.GetTableBucketByHash(map_.GetHasher()(map_.data_.back().first));
+        map_.EraseWithoutRehash(key, hash);
+        BeginWrite();
+        StoreBucket(bucket);
+        if (last_bucket != bucket) {
+            StoreBucket(last_bucket);
+        }
+        if (position < map_.data_.size()) {
+            StoreElement(position, map_.data_[position]);
+        }
+        data_size_.store(map_.data_.size(), std::memory_order_release);
+        EndWrite();
+        RehashIfNecessary();
+        return true;
+    }
+
+    // Writer thread only.
+    // Complexity: O(1) guaranteed.
+    size_t size() const {
+        return map_.size();
+    }
+
+    // Writer thread only.
+    // Complexity: O(1) guaranteed.
+    bool empty() const {
+        return map_.empty();
+    }
+
+  private:
+    using Word = std::atomic<uint64_t>;
+    using Index = std::atomic<size_t>;
+
+    // # of words holding object representation of a key, of a value and of an element.
+    constexpr static size_t kKeyWords = (sizeof(KeyType) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    constexpr static size_t kValueWords =
+            (sizeof(ValueType) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    constexpr static size_t kElementWords = kKeyWords + kValueWords;
+
+    // Bucket of the reader table, an array of indexes into the array of elements.
+    struct Bucket {
+        std::atomic<Index*> indexes{nullptr};
+        std::atomic<size_t> size{0};
+        // Used by the writer only.
+        size_t capacity = 0;
+    };
+
+    // Reader table; owns current arrays of its buckets.
+    struct Table {
+        // Complexity: O(bucket_count) guaranteed.
+        explicit Table(const size_t bucket_count) :
+                buckets(new Bucket[bucket_count]), bucket_count(bucket_count) {}
+
+        // Complexity: O(bucket_count) guaranteed.
+        ~Table() {
+            for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+                delete[] buckets[bucket].indexes.load(std::memory_order_relaxed);
+            }
+        }
+
+        const std::unique_ptr<Bucket[]> buckets;
+        const size_t bucket_count;
+    };
+
+    // Checks whether some write started after sequence was read;
+    // everything read before the call is consistent if it returns false.
+    // Complexity: O(1) guaranteed.
+    bool Changed(const uint64_t sequence) const {
+        // Loads before the call are acquire loads: if one of them has read a release store
+        // of a write, the increment of sequence_ that began the write is visible here.
+        return sequence_.load(std::memory_order_relaxed) != sequence;
+    }
+
+    // Lookup in the reader table, which validates every pointer and index it has read
+    // before dereferencing it. Returns false if the result is inconsistent.
+    // Complexity: O(1) average case.
+    bool OptimisticFind(const KeyType& key, const size_t hash, const uint64_t sequence,
+                        std::optional<ValueType>& result) const {
+        // The table is replaced only by a retirement, so it is alive and fully built.
+        const Table* table = table_.load(std::memory_order_acquire);
+        const Bucket& bucket = table->buckets[hash % table->bucket_count];
+        const Index* indexes = bucket.indexes.load(std::memory_order_acquire);
+        size_t bucket_size = bucket.size.load(std::memory_order_acquire);
+        const Word* data = data_.load(std::memory_order_acquire);
+        size_t data_size = data_size_.load(std::memory_order_acquire);
+        if (Changed(sequence)) {
+            return false;
+        }
+        for (size_t ind = 0; ind < bucket_size; ++ind) {
+            size_t data_index = indexes[ind].load(std::memory_order_acquire);
+            if (Changed(sequence) || data_index >= data_size) {
+                return false;
+            }
+            const Word* element = data + data_index * kElementWords;
+            KeyType element_key = LoadWords<KeyType>(element);
+            if (Changed(sequence)) {
+                return false;
+            }
+            if (map_.GetKeyEqual()(element_key, key)) {
+                ValueType value = LoadWords<ValueType>(element + kKeyWords);
+                if (Changed(sequence)) {
+                    return false;
+                }
+                result = value;
+                return true;
+            }
+        }
+        return true;
+    }
+
+    // Copies object representation of T from words with acquire loads.
+    // Complexity: O(sizeof(T)) guaranteed.
+    template<class T>
+    static T LoadWords(const Word* words) {
+        constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        alignas(alignof(T) > alignof(uint64_t) ? alignof(T) : alignof(uint64_t))
+                uint64_t buffer[kWords];
+        for (size_t ind = 0; ind < kWords; ++ind) {
+            buffer[ind] = words[ind].load(std::memory_order_acquire);
+        }
+        T value;
+        std::memcpy(static_cast<void*>(&value), buffer, sizeof(T));
+        return value;
+    }
+
+    // Stores object representation of value into words with release stores.
+    // Complexity: O(sizeof(T)) guaranteed.
+    template<class T>
+    static void StoreWords(Word* words, const T& value) {
+        constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+        uint64_t buffer[kWords] = {};
+        std::memcpy(buffer, static_cast<const void*>(&value), sizeof(T));
+        for (size_t ind = 0; ind < kWords; ++ind) {
+            words[ind].store(buffer[ind], std::memory_order_release);
+        }
+    }
+
+    // Must be called between BeginWrite and EndWrite, unless position is not published yet.
+    // Complexity: O(1) guaranteed.
+    void StoreElement(const size_t position, const KeyValuePair& element) {
+        Word* words = data_.load(std::memory_order_relaxed) + position * kElementWords;
+        StoreWords(words, element.first);
+        StoreWords(words + kKeyWords, element.second);
+    }
+
+    // Copies bucket of map_ into the reader table, whose bucket must have enough capacity.
+    // Must be called between BeginWrite and EndWrite.
+    // Complexity: O(|bucket|) guaranteed.
+    void StoreBucket(const size_t bucket) {
+        const std::vector<size_t>& source = map_.hash_table_[bucket];
+        Bucket& target = table_.load(std::memory_order_relaxed)->buckets[bucket];
+        Index* indexes = target.indexes.load(std::memory_order_relaxed);
+        for (size_t ind = 0; ind < source.size(); ++ind) {
+            indexes[ind].store(source[ind], std::memory_order_release);
+        }
+        target.size.store(source.size(), std::memory_order_release);
+    }
+
+    // Makes the array of elements hold at least size elements, retiring the old one.
+    // Complexity: O(size) guaranteed if the array grows; otherwise O(1) guaranteed.
+    void ReserveData(const size_t size) {
+        if (size <= data_capacity_) {
+            return;
+        }
+        data_capacity_ = std::max(2 * data_capacity_, size);
+        Word* grown = new Word[data_capacity_ * kElementWords];
+        Word* old = data_.load(std::memory_order_relaxed);
+        size_t old_words = data_size_.load(std::memory_order_relaxed) * kElementWords;
+        for (size_t ind = 0; ind < old_words; ++ind) {
+            grown[ind].store(old[ind].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        BeginWrite();
+        data_.store(grown, std::memory_order_release);
+        EndWrite();
+        Retire(old);
+    }
+
+    // Makes bucket of the reader table hold at least size indexes, retiring the old array.
+    // Complexity: O(size) guaranteed if the array grows; otherwise O(1) guaranteed.
+    void ReserveBucket(const size_t bucket, const size_t size) {
+        Bucket& target = table_.load(std::memory_order_relaxed)->buckets[bucket];
+        if (size <= target.capacity) {
+            return;
+        }
+        target.capacity = std::max(2 * target.capacity, size);
+        Index* grown = new Index[target.capacity];
+        Index* old = target.indexes.load(std::memory_order_relaxed);
+        size_t old_size = target.size.load(std::memory_order_relaxed);
+        for (size_t ind = 0; ind < old_size; ++ind) {
+            grown[ind].store(old[ind].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        BeginWrite();
+        target.indexes.store(grown, std::memory_order_release);
+        EndWrite();
+        Retire(old);
+    }
+
+    // Builds reader table from hash_table_ of map_.
+    // Complexity: O(# of elements in hash map + |hash_table|) guaranteed.
+    Table* BuildTable() const {
+        size_t bucket_count = map_.hash_table_.size();
+        Table* table = new Table(bucket_count);
+        for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+            const std::vector<size_t>& source = map_.hash_table_[bucket];
+            if (source.empty()) {
+                continue;
+            }
+            Bucket& target = table->buckets[bucket];
+            Index* indexes = new Index[source.size()];
+            for (size_t ind = 0; ind < source.size(); ++ind) {
+                indexes[ind].store(source[ind], std::memory_order_relaxed);
+            }
+            target.indexes.store(indexes, std::memory_order_relaxed);
+            target.size.store(source.size(), std::memory_order_relaxed);
+            target.capacity = source.size();
+        }
+        return table;
+    }
+
+    // Stores between BeginWrite and EndWrite must be release stores, which keep the increment
+    // before them.
+    // Complexity: O(1) guaranteed.
+    void BeginWrite() {
+        sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    void EndWrite() {
+        sequence_.store(sequence_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Resizes hash table if HashMap resize policy requires it. The new reader table is built
+    // aside and swapped in; the old one is retired.
+    // Complexity: O(|hash_table|) guaranteed if we perform rehash; otherwise O(1) guaranteed.
+    void RehashIfNecessary() {
+        size_t new_size = map_.GetNewTableSize();
+        if (new_size != map_.hash_table_.size()) {
+            std::vector<std::vector<size_t>> table(new_size);
+            map_.FillTable(table);
+            map_.hash_table_.swap(table);
+            map_.RebuildLongBuckets();
+            Table* reader_table = BuildTable();
+            BeginWrite();
+            Table* old = table_.exchange(reader_table, std::memory_order_release);
+            EndWrite();
+            Retire(old);
+        }
+    }
+
+    // Keeps object allocated with new (or new[] for arrays) alive until readers that may
+    // see it finish.
+    // Complexity: O(1) amortized, plus EpochDomain::reclaim.
+    template<class Object>
+    void Retire(Object* object) {
+        if (object == nullptr) {
+            return;
+        }
+        using Owner = typename std::conditional<std::is_same<Object, Table>::value,
+                                                std::unique_ptr<Object>,
+                                                std::unique_ptr<Object[]>>::type;
+        reclamation_.retire(std::shared_ptr<void>(Owner(object)));
+    }
+
+  private:
+    Map map_;
+    std::atomic<uint64_t> sequence_{0};
+    // Reader table, mirror of map_.
+    std::atomic<Table*> table_{nullptr};
+    std::atomic<Word*> data_{nullptr};
+    std::atomic<size_t> data_size_{0};
+    // Used by the writer only.
+    size_t data_capacity_ = 0;
+    EpochDomain reclamation_;
+};
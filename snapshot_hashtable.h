@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "epoch_reclamation.h"
+#include "hashtable.h"
+
+/*
+ * Read-copy-update wrapper around HashMap for read-mostly data.
+ * Current version of the map is an immutable HashMap owned by std::shared_ptr:
+ * readers take a snapshot (shared pointer to a version) and use it without any
+ * synchronization for as long as they want, writers copy the current version, apply
+ * a batch of changes to the copy and publish it as the new current one.
+ * A version is destroyed when the last snapshot of it is released.
+ * The current version is published through a plain atomic pointer to a holder of its
+ * shared pointer; replaced holders are retired to an EpochDomain. So find() pins the
+ * domain and looks the key up in the current version without touching any reference
+ * counter or lock, and snapshot() only adds the copy of a shared pointer that is never
+ * modified concurrently. Threads that need the whole map for many lookups should use
+ * Reader: it keeps its own snapshot and refreshes it only after a new version is
+ * published, so lookups through it cost one atomic load of the version number.
+ * The domain has reader_slots slots, threads beyond that many pin through a shared
+ * counter and delay freeing of replaced holders (see EpochDomain).
+ */
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+         class KeyEqual = std::equal_to<KeyType>>
+class SnapshotHashMap {
+  public:
+    using Map = HashMap<KeyType, ValueType, Hash, KeyEqual>;
+    using KeyValuePair = typename Map::KeyValuePair;
+    using Snapshot = std::shared_ptr<const Map>;
+
+    // Cached snapshot for a single thread. Holds the version it has seen last alive
+    // until the next call of get().
+    class Reader {
+        friend SnapshotHashMap;
+      public:
+        // Returns current version of the map.
+        // Complexity: O(1) guaranteed.
+        const Map& get() {
+            uint64_t version = owner_->version_.load(std::memory_order_acquire);
+            if (version != version_) {
+                snapshot_ = owner_->snapshot();
+                version_ = version;
+            }
+            return *snapshot_;
+        }
+
+        // Returns copy of the value with key == Key in the current version, if it exists.
+        // Complexity: O(1) average case.
+        std::optional<ValueType> find(const KeyType& key) {
+            return FindIn(get(), key);
+        }
+
+      private:
+        explicit Reader(const SnapshotHashMap* owner) : owner_(owner) {}
+
+      private:
+        const SnapshotHashMap* owner_;
+        Snapshot snapshot_;
+        uint64_t version_ = 0;
+    };
+
+  public:
+    // Complexity: O(reader_slots) guaranteed.
+    explicit SnapshotHashMap(const Hash& hasher_ = Hash(),
+                             const KeyEqual& key_equal_ = KeyEqual(),
+                             const size_t reader_slots = EpochDomain::kDefaultSlotCount) :
+            reclamation_(reader_slots),
+            current_(new Version{std::make_shared<const Map>(hasher_, key_equal_)}) {}
+
+    // Complexity: O(reader_slots) guaranteed.
+    explicit SnapshotHashMap(Map map,
+                             const size_t reader_slots = EpochDomain::kDefaultSlotCount) :
+            reclamation_(reader_slots),
+            current_(new Version{std::make_shared<const Map>(std::move(map))}) {}
+
+    SnapshotHashMap(const SnapshotHashMap&) = delete;
+    SnapshotHashMap& operator=(const SnapshotHashMap&) = delete;
+
+    // Complexity: O(1) guaranteed, plus destruction of versions no snapshot holds.
+    ~SnapshotHashMap() {
+        delete current_.load(std::memory_order_relaxed);
+    }
+
+    // Returns current version of the map.
+    // Complexity: O(1) guaranteed.
+    Snapshot snapshot() const {
+        EpochDomain::Guard guard(reclamation_);
+        return current_.load(std::memory_order_acquire)->map;
+    }
+
+    // Returns reader bound to this map, which must outlive it.
+    // Complexity: O(1) guaranteed.
+    Reader reader() const {
+        return Reader(this);
+    }
+
+    // Returns copy of the value with key == Key in the current version, if it exists.
+    // Complexity: O(1) average case.
+    std::optional<ValueType> find(const KeyType& key) const {
+        EpochDomain::Guard guard(reclamation_);
+        return FindIn(*current_.load(std::memory_order_acquire)->map, key);
+    }
+
+    // Calls function(Map&) for a copy of the current version and publishes the result.
+    // Concurrent updates are serialized, so none of them is lost.
+    // Complexity: O(# of elements in hash map) guaranteed plus running time of function.
+    template<class Function>
+    void update(Function function) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        std::shared_ptr<Map> next =
+                std::make_shared<Map>(*current_.load(std::memory_order_relaxed)->map);
+        function(*next);
+        Publish(Snapshot(std::move(next)));
+    }
+
+    // Replaces current version with the given map.
+    // Complexity: O(1) guaranteed.
+    void publish(Map map) {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        Publish(std::make_shared<const Map>(std::move(map)));
+    }
+
+  private:
+    // Holder of a published version: readers reach the shared pointer through a plain
+    // pointer to it, which is safe to load while they have the domain pinned.
+    struct Version {
+        Snapshot map;
+    };
+
+    // Complexity: O(1) average case.
+    static std::optional<ValueType> FindIn(const Map& map, const KeyType& key) {
+        auto key_iterator = map.find(key);
+        if (key_iterator == map.end()) {
+            return std::nullopt;
+        }
+        return key_iterator->second;
+    }
+
+    // Makes map the current version and retires the holder of the previous one.
+    // Must be called with update_mutex_ locked.
+    // Complexity: O(1) amortized, plus EpochDomain::reclaim.
+    void Publish(Snapshot map) {
+        Version* previous = current_.exchange(new Version{std::move(map)},
+                                              std::memory_order_acq_rel);
+        version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        reclamation_.retire(std::shared_ptr<void>(std::unique_ptr<Version>(previous)));
+    }
+
+  private:
+    mutable EpochDomain reclamation_;
+    std::atomic<Version*> current_;
+    // Number of published versions; Reader compares it with the version of its snapshot.
+    std::atomic<uint64_t> version_{1};
+    std::mutex update_mutex_;
+};
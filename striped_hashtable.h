@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "hashtable.h"
+
+/*
+ * Thread-safe hash map with the layout of HashMap (dense array of elements plus hash table
+ * of buckets with indexes into it) and locking at bucket granularity: bucket b is protected
+ * by lock of stripe b % stripe_count, so operations on keys from different stripes run in
+ * parallel, even if they are hot keys of what would be a single shard of ConcurrentHashMap.
+ * Elements are appended to the dense array by reserving an index with an atomic counter.
+ * The array is split into segments of doubling size, which are never moved, so appending
+ * doesn't invalidate elements used by other threads.
+ * Erased elements are destroyed and marked dead; they are compacted away on resize.
+ * Resize locks all stripes (in fixed order, so it can't deadlock), rebuilds hash table and
+ * increments the global epoch. Operations remember the epoch before locking a stripe and
+ * retry if it has changed by the time they hold the lock, since their bucket
+ * (and so their stripe) might have changed.
+ * Resize policy is the one of HashMap.
+ */
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+         class KeyEqual = std::equal_to<KeyType>>
+class StripedHashMap {
+  public:
+    constexpr static size_t kDefaultStripeCount = 256;
+    constexpr static size_t kFirstSegmentSize = 64;
+    constexpr static size_t kMaxSegments = 48;
+
+    using KeyValuePair = typename HashMap<KeyType, ValueType, Hash, KeyEqual>::KeyValuePair;
+
+  public:
+    // Complexity: O(stripe_count) guaranteed.
+    explicit StripedHashMap(const size_t stripe_count = kDefaultStripeCount,
+                            const Hash& hasher_ = Hash(),
+                            const KeyEqual& key_equal_ = KeyEqual()) :
+            functions_(hasher_, key_equal_) {
+        stripe_count_ = 1;
+        while (stripe_count_ < stripe_count) {
+            stripe_count_ *= 2;
+        }
+        stripes_.reset(new Stripe[stripe_count_]);
+        hash_table_.resize(kMinLoad);
+        bucket_count_.store(kMinLoad, std::memory_order_relaxed);
+        for (std::atomic<Element*>& segment : segments_) {
+            segment.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    StripedHashMap(const StripedHashMap&) = delete;
+    StripedHashMap& operator=(const StripedHashMap&) = delete;
+
+    // Complexity: O(# of elements ever inserted since last resize + # of segments) guaranteed.
+    ~StripedHashMap() {
+        size_t element_count = element_count_.load(std::memory_order_relaxed);
+        for (size_t ind = 0; ind < element_count; ++ind) {
+            if (GetElement(ind).alive) {
+                GetElement(ind).Destroy();
+            }
+        }
+        for (std::atomic<Element*>& segment : segments_) {
+            delete[] segment.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns copy of the value with key == Key if it exists.
+    // Complexity: O(1) average case.
+    std::optional<ValueType> find(const KeyType& key) const {
+        std::unique_lock<std::mutex> lock;
+        size_t bucket = LockBucket(key, lock);
+        size_t data_index = FindInBucket(bucket, key);
+        if (data_index == kNotFound) {
+            return std::nullopt;
+        }
+        return GetElement(data_index).Pair().second;
+    }
+
+    // Complexity: O(1) average case.
+    bool contains(const KeyType& key) const {
+        std::unique_lock<std::mutex> lock;
+        size_t bucket = LockBucket(key, lock);
+        return FindInBucket(bucket, key) != kNotFound;
+    }
+
+    // Inserts element if its key is not present yet; returns whether it was inserted.
+    // Complexity: O(1) amortized average case.
+    bool insert(const KeyValuePair& element) {
+        {
+            std::unique_lock<std::mutex> lock;
+            size_t bucket = LockBucket(element.first, lock);
+            if (FindInBucket(bucket, element.first) != kNotFound) {
+                return false;
+            }
+            Append(bucket, element);
+        }
+        ResizeIfNecessary();
+        return true;
+    }
+
+    // Sets value of the element with key == Key, inserting it if necessary.
+    // Complexity: O(1) amortized average case.
+    void insert_or_assign(const KeyType& key, const ValueType& value) {
+        update(key, [&value](ValueType& element_value) {
+            element_value = value;
+        });
+    }
+
+    // Calls function(value) for the element with key == Key (inserting it with default value
+    // if necessary) while holding the lock of its bucket, returns copy of the resulting value.
+    // Complexity: O(1) amortized average case plus running time of function.
+    template<class Function>
+    ValueType update(const KeyType& key, Function function) {
+        ValueType result;
+        bool inserted = false;
+        {
+            std::unique_lock<std::mutex> lock;
+            size_t bucket = LockBucket(key, lock);
+            size_t data_index = FindInBucket(bucket, key);
+            if (data_index == kNotFound) {
+                data_index = Append(bucket, {key, ValueType()});
+                inserted = true;
+            }
+            ValueType& value = GetElement(data_index).Pair().second;
+            function(value);
+            result = value;
+        }
+        if (inserted) {
+            ResizeIfNecessary();
+        }
+        return result;
+    }
+
+    // Removes element with key == Key; returns whether it existed.
+    // Complexity: O(1) amortized average case.
+    bool erase(const KeyType& key) {
+        {
+            std::unique_lock<std::mutex> lock;
+            size_t bucket = LockBucket(key, lock);
+            std::vector<size_t>& chain = hash_table_[bucket];
+            auto position = std::find_if(chain.begin(), chain.end(), [&](size_t data_index) {
+                return functions_.key_equal()(GetElement(data_index).Pair().first, key);
+            });
+            if (position == chain.end()) {
+                return false;
+            }
+            GetElement(*position).Destroy();
+            chain.erase(position);
+            size_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        ResizeIfNecessary();
+        return true;
+    }
+
+    // Complexity: O(1) guaranteed.
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    // Complexity: O(1) guaranteed.
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Number of resizes performed so far.
+    // Complexity: O(1) guaranteed.
+    uint64_t epoch() const {
+        return epoch_.load(std::memory_order_acquire);
+    }
+
+    // Complexity: O(1) guaranteed.
+    size_t stripe_count() const {
+        return stripe_count_;
+    }
+
+    // Calls function(const KeyValuePair&) for every element while holding all locks.
+    // Complexity: O(# of elements in hash map + stripe_count) guaranteed.
+    template<class Function>
+    void for_each(Function function) const {
+        std::vector<std::unique_lock<std::mutex>> locks = LockAll();
+        for (const std::vector<size_t>& chain : hash_table_) {
+            for (size_t data_index : chain) {
+                function(static_cast<const KeyValuePair&>(GetElement(data_index).Pair()));
+            }
+        }
+    }
+
+  private:
+    using Map = HashMap<KeyType, ValueType, Hash, KeyEqual>;
+
+    constexpr static size_t kMinLoad = Map::kMinLoad;
+    constexpr static size_t kMinLoadFactor = Map::kMinLoadFactor;
+    constexpr static size_t kMaxLoadFactor = Map::kMaxLoadFactor;
+    constexpr static size_t kNotFound = SIZE_MAX;
+
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+    };
+
+    // Slot of the dense array, which may hold an element.
+    struct Element {
+        KeyValuePair& Pair() {
+            return *std::launder(reinterpret_cast<KeyValuePair*>(storage));
+        }
+
+        template<class Pair>
+        void Construct(Pair&& pair) {
+            new (storage) KeyValuePair(std::forward<Pair>(pair));
+            alive = true;
+        }
+
+        void Destroy() {
+            Pair().~KeyValuePair();
+            alive = false;
+        }
+
+        alignas(KeyValuePair) unsigned char storage[sizeof(KeyValuePair)];
+        bool alive = false;
+    };
+
+  private:
+    // Finds bucket of the key and locks its stripe, making sure no resize happened between
+    // choosing the bucket and locking. Returns the bucket.
+    // Complexity: O(1) guaranteed if there is no concurrent resize.
+    size_t LockBucket(const KeyType& key, std::unique_lock<std::mutex>& lock) const {
+        const size_t hash = functions_.hasher()(key);
+        while (true) {
+            uint64_t epoch = epoch_.load(std::memory_order_acquire);
+            size_t bucket = hash % bucket_count_.load(std::memory_order_acquire);
+            lock = std::unique_lock<std::mutex>(stripes_[bucket & (stripe_count_ - 1)].mutex);
+            if (epoch_.load(std::memory_order_relaxed) == epoch) {
+                return bucket;
+            }
+            lock.unlock();
+        }
+    }
+
+    // Locks stripes in increasing order.
+    // Complexity: O(stripe_count) guaranteed.
+    std::vector<std::unique_lock<std::mutex>> LockAll() const {
+        std::vector<std::unique_lock<std::mutex>> locks;
+        locks.reserve(stripe_count_);
+        for (size_t ind = 0; ind < stripe_count_; ++ind) {
+            locks.emplace_back(stripes_[ind].mutex);
+        }
+        return locks;
+    }
+
+    // Returns index in the dense array of the element with key == Key, stripe of the bucket
+    // must be locked.
+    // Complexity: O(1) average case.
+    size_t FindInBucket(const size_t bucket, const KeyType& key) const {
+        for (size_t data_index : hash_table_[bucket]) {
+            if (functions_.key_equal()(GetElement(data_index).Pair().first, key)) {
+                return data_index;
+            }
+        }
+        return kNotFound;
+    }
+
+    // Adds element to the dense array and to the bucket, stripe of the bucket must be locked.
+    // Returns index of the element.
+    // Complexity: O(1) amortized.
+    size_t Append(const size_t bucket, const KeyValuePair& element) {
+        size_t data_index = element_count_.fetch_add(1, std::memory_order_relaxed);
+        GetOrAllocateElement(data_index).Construct(element);
+        hash_table_[bucket].push_back(data_index);
+        size_.fetch_add(1, std::memory_order_relaxed);
+        return data_index;
+    }
+
+    // Segment s holds indexes [kFirstSegmentSize * (2^s - 1), kFirstSegmentSize * (2^(s+1) - 1)).
+    // Complexity: O(1) guaranteed.
+    static std::pair<size_t, size_t> GetSegmentPosition(const size_t data_index) {
+        size_t scaled_index = data_index / kFirstSegmentSize + 1;
+        size_t segment = 0;
+        while (scaled_index >> (segment + 1)) {
+            ++segment;
+        }
+        size_t segment_begin = kFirstSegmentSize * ((static_cast<size_t>(1) << segment) - 1);
+        return {segment, data_index - segment_begin};
+    }
+
+    // Complexity: O(1) guaranteed.
+    Element& GetElement(const size_t data_index) const {
+        std::pair<size_t, size_t> position = GetSegmentPosition(data_index);
+        return segments_[position.first].load(std::memory_order_acquire)[position.second];
+    }
+
+    // Same as GetElement, but allocates the segment if the index is the first one to reach it.
+    // Complexity: O(1) guaranteed, except for allocation of the segment.
+    Element& GetOrAllocateElement(const size_t data_index) {
+        std::pair<size_t, size_t> position = GetSegmentPosition(data_index);
+        std::atomic<Element*>& segment = segments_[position.first];
+        Element* elements = segment.load(std::memory_order_acquire);
+        if (elements == nullptr) {
+            Element* allocated = new Element[kFirstSegmentSize << position.first];
+            if (segment.compare_exchange_strong(elements, allocated, std::memory_order_acq_rel)) {
+                elements = allocated;
+            } else {
+                delete[] allocated;
+            }
+        }
+        return elements[position.second];
+    }
+
+    // Checks resize policy of HashMap for the current # of elements (and # of dead slots)
+    // and resizes hash table if it is broken; dead slots are compacted away.
+    // Complexity: O(# of elements) guaranteed if we perform resize; otherwise O(1) guaranteed.
+    void ResizeIfNecessary() {
+        if (!NeedsResize()) {
+            return;
+        }
+        std::vector<std::unique_lock<std::mutex>> locks = LockAll();
+        if (!NeedsResize()) {
+            return;
+        }
+        size_t new_size = LoadFactorBroken() ? std::max(size(), kMinLoad) : hash_table_.size();
+        Compact();
+        hash_table_.clear();
+        hash_table_.resize(new_size);
+        size_t element_count = element_count_.load(std::memory_order_relaxed);
+        for (size_t ind = 0; ind < element_count; ++ind) {
+            size_t hash = functions_.hasher()(GetElement(ind).Pair().first);
+            hash_table_[hash % new_size].push_back(ind);
+        }
+        bucket_count_.store(new_size, std::memory_order_release);
+        epoch_.store(epoch_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Resize is needed if resize policy is broken or if dead slots take more than a half
+    // of the dense array.
+    // Complexity: O(1) guaranteed.
+    bool NeedsResize() const {
+        return LoadFactorBroken() ||
+               element_count_.load(std::memory_order_relaxed) > 2 * size() + kFirstSegmentSize;
+    }
+
+    // Complexity: O(1) guaranteed.
+    bool LoadFactorBroken() const {
+        size_t element_count = size();
+        size_t bucket_count = bucket_count_.load(std::memory_order_relaxed);
+        size_t new_size = std::max(element_count, kMinLoad);
+        return (bucket_count * kMaxLoadFactor < element_count ||
+                element_count * kMinLoadFactor < bucket_count) && bucket_count != new_size;
+    }
+
+    // Moves alive elements to the beginning of the dense array; all stripes must be locked.
+    // Complexity: O(# of elements ever inserted since last resize) guaranteed.
+    void Compact() {
+        size_t element_count = element_count_.load(std::memory_order_relaxed);
+        size_t kept = 0;
+        for (size_t ind = 0; ind < element_count; ++ind) {
+            Element& element = GetElement(ind);
+            if (!element.alive) {
+                continue;
+            }
+            if (kept != ind) {
+                GetElement(kept).Construct(std::move(element.Pair()));
+                element.Destroy();
+            }
+            ++kept;
+        }
+        element_count_.store(kept, std::memory_order_relaxed);
+    }
+
+  private:
+    std::unique_ptr<Stripe[]> stripes_;
+    size_t stripe_count_;
+    std::vector<std::vector<size_t>> hash_table_;
+    std::atomic<size_t> bucket_count_;
+    std::atomic<uint64_t> epoch_{0};
+    mutable std::atomic<Element*> segments_[kMaxSegments];
+    // # of used slots of the dense array (including dead ones) and # of alive elements.
+    std::atomic<size_t> element_count_{0};
+    std::atomic<size_t> size_{0};
+    // Stateless hash function and key equality take no space (see HashMapFunctions).
+    HashMapFunctions<Hash, KeyEqual> functions_;
+};
@@ -0,0 +1,314 @@
+/*
+ * Multi-threaded smoke tests of the concurrent maps and of EpochDomain: several threads
+ * run random operations at the same time, readers check every value they see against
+ * what writers could have written, and final contents are compared with the expected ones.
+ * Most useful when built with -DHASHMAP_SANITIZE=thread or =address,undefined.
+ */
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "concurrent_hashtable.h"
+#include "epoch_reclamation.h"
+#include "hash.h"
+#include "lock_free_hashtable.h"
+#include "seqlock_hashtable.h"
+#include "snapshot_hashtable.h"
+#include "striped_hashtable.h"
+#include "test_check.h"
+
+namespace {
+
+constexpr size_t kThreads = 4;
+constexpr uint64_t kKeysPerThread = 5000;
+
+template<class Function>
+void RunThreads(const size_t count, const Function& function) {
+    std::vector<std::thread> threads;
+    for (size_t thread = 0; thread < count; ++thread) {
+        threads.emplace_back(function, thread);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Every thread owns keys congruent to its index; it inserts them, erases every third one and
+// assigns 2 * key to the rest, while all threads increment a few shared counters.
+template<class Hash>
+void TestConcurrentHashMap() {
+    ConcurrentHashMap<uint64_t, uint64_t, Hash> map(8);
+    const uint64_t kCounters = 4;
+    RunThreads(kThreads, [&map, kCounters](size_t thread) {
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            uint64_t key = kCounters + ind * kThreads + thread;
+            HASHMAP_CHECK(map.insert({key, key}));
+            map.update(ind % kCounters, [](uint64_t& value) {
+                ++value;
+            });
+            std::optional<uint64_t> value = map.find(key - kThreads);
+            HASHMAP_CHECK(ind == 0 || !value || *value == key - kThreads ||
+                          *value == 2 * (key - kThreads));
+        }
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            uint64_t key = kCounters + ind * kThreads + thread;
+            if (ind % 3 == 0) {
+                HASHMAP_CHECK(map.erase(key));
+            } else {
+                map.insert_or_assign(key, 2 * key);
+            }
+        }
+    });
+    uint64_t counter_total = 0;
+    for (uint64_t key = 0; key < kCounters; ++key) {
+        counter_total += map.at(key);
+    }
+    HASHMAP_CHECK(counter_total == kThreads * kKeysPerThread);
+    for (uint64_t key = kCounters; key < kCounters + kThreads * kKeysPerThread; ++key) {
+        uint64_t ind = (key - kCounters) / kThreads;
+        std::optional<uint64_t> value = map.find(key);
+        HASHMAP_CHECK(ind % 3 == 0 ? !value : value && *value == 2 * key);
+    }
+}
+
+// One writer inserts keys with value 3 * key, reassigns and erases some of them, while
+// readers check that every value they find is one the writer has stored.
+void TestSeqlockHashMap() {
+    SeqlockHashMap<uint64_t, uint64_t> map;
+    const uint64_t kKeys = kThreads * kKeysPerThread;
+    std::atomic<bool> done{false};
+    std::thread writer([&map, &done, kKeys]() {
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            HASHMAP_CHECK(map.insert({key, 3 * key}));
+            if (key % 4 == 1) {
+                map.insert_or_assign(key, 3 * key + 1);
+            }
+            if (key % 4 == 2) {
+                HASHMAP_CHECK(map.erase(key));
+            }
+        }
+        done.store(true, std::memory_order_release);
+    });
+    RunThreads(kThreads - 1, [&map, &done, kKeys](size_t thread) {
+        std::mt19937_64 random(thread);
+        while (!done.load(std::memory_order_acquire)) {
+            uint64_t key = random() % kKeys;
+            std::optional<uint64_t> value = map.find(key);
+            HASHMAP_CHECK(!value || *value == 3 * key || *value == 3 * key + 1);
+        }
+    });
+    writer.join();
+    for (uint64_t key = 0; key < kKeys; ++key) {
+        std::optional<uint64_t> value = map.find(key);
+        HASHMAP_CHECK(key % 4 == 2 ? !value : value && *value == 3 * key + (key % 4 == 1));
+    }
+    HASHMAP_CHECK(map.size() == kKeys - kKeys / 4);
+}
+
+// Writers publish versions holding keys [0, n) with growing n; readers check that
+// every version they see is a prefix.
+void TestSnapshotHashMap() {
+    SnapshotHashMap<uint64_t, uint64_t> map;
+    const uint64_t kVersions = 200;
+    const uint64_t kKeysPerVersion = 20;
+    std::atomic<bool> done{false};
+    std::thread writer([&map, &done, kVersions, kKeysPerVersion]() {
+        for (uint64_t version = 0; version < kVersions; ++version) {
+            map.update([version, kKeysPerVersion](HashMap<uint64_t, uint64_t>& next) {
+                for (uint64_t ind = 0; ind < kKeysPerVersion; ++ind) {
+                    uint64_t key = version * kKeysPerVersion + ind;
+                    next.insert({key, key + 1});
+                }
+            });
+        }
+        done.store(true, std::memory_order_release);
+    });
+    RunThreads(kThreads - 1, [&map, &done](size_t thread) {
+        auto reader = map.reader();
+        std::mt19937_64 random(thread);
+        while (!done.load(std::memory_order_acquire)) {
+            const HashMap<uint64_t, uint64_t>& current = reader.get();
+            size_t size = current.size();
+            uint64_t key = size == 0 ? 0 : random() % size;
+            HASHMAP_CHECK(size == 0 || current.at(key) == key + 1);
+            std::optional<uint64_t> value = map.find(key);
+            HASHMAP_CHECK(size == 0 || (value && *value == key + 1));
+        }
+    });
+    writer.join();
+    HASHMAP_CHECK(map.snapshot()->size() == kVersions * kKeysPerVersion);
+}
+
+// Threads add to shared counters and insert their own keys from a small initial capacity,
+// so that tables are migrated while other threads use them.
+void TestLockFreeHashMap() {
+    LockFreeHashMap<uint64_t, uint64_t> map(4);
+    const uint64_t kCounters = 16;
+    RunThreads(kThreads, [&map, kCounters](size_t thread) {
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            map.fetch_add(ind % kCounters, 1);
+            uint64_t key = kCounters + ind * kThreads + thread;
+            HASHMAP_CHECK(map.insert(key, key));
+            std::optional<uint64_t> value = map.find(key);
+            HASHMAP_CHECK(value && *value == key);
+        }
+    });
+    uint64_t counter_total = 0;
+    for (uint64_t key = 0; key < kCounters; ++key) {
+        counter_total += map.find(key).value_or(0);
+    }
+    HASHMAP_CHECK(counter_total == kThreads * kKeysPerThread);
+    for (uint64_t key = kCounters; key < kCounters + kThreads * kKeysPerThread; ++key) {
+        HASHMAP_CHECK(map.find(key) == key);
+    }
+}
+
+// Values of a narrow signed type: they must lie in [0, kMaxValue] (the highest bit marks
+// frozen slots), and they survive the migrations of a map grown from a small capacity.
+void TestLockFreeHashMapValueRange() {
+    using Map = LockFreeHashMap<uint16_t, int8_t>;
+    Map map(4);
+    HASHMAP_CHECK(Map::kMaxValue == 126);
+    const uint16_t kKeys = 1000;
+    for (uint16_t key = 0; key < kKeys; ++key) {
+        HASHMAP_CHECK(map.insert(key, static_cast<int8_t>(key % 127)));
+    }
+    for (uint16_t key = 0; key < kKeys; ++key) {
+        HASHMAP_CHECK(map.find(key) == key % 127);
+    }
+    HASHMAP_CHECK(map.fetch_add(0, Map::kMaxValue) == 0);
+    for (int8_t value : {int8_t(-1), int8_t(127)}) {
+        bool rejected = false;
+        try {
+            map.insert(kKeys, value);
+        } catch (const std::invalid_argument&) {
+            rejected = true;
+        }
+        HASHMAP_CHECK(rejected);
+    }
+    bool rejected = false;
+    try {
+        map.fetch_add(1, Map::kMaxValue);
+    } catch (const std::invalid_argument&) {
+        rejected = true;
+    }
+    HASHMAP_CHECK(rejected);
+    HASHMAP_CHECK(map.find(1) == 1);
+    HASHMAP_CHECK(!map.find(kKeys));
+}
+
+// Same workload as for ConcurrentHashMap.
+void TestStripedHashMap() {
+    StripedHashMap<uint64_t, uint64_t> map(16);
+    const uint64_t kCounters = 4;
+    RunThreads(kThreads, [&map, kCounters](size_t thread) {
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            uint64_t key = kCounters + ind * kThreads + thread;
+            HASHMAP_CHECK(map.insert({key, key}));
+            map.update(ind % kCounters, [](uint64_t& value) {
+                ++value;
+            });
+        }
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            uint64_t key = kCounters + ind * kThreads + thread;
+            if (ind % 3 == 0) {
+                HASHMAP_CHECK(map.erase(key));
+            } else {
+                map.insert_or_assign(key, 2 * key);
+            }
+        }
+    });
+    uint64_t counter_total = 0;
+    for (uint64_t key = 0; key < kCounters; ++key) {
+        counter_total += map.find(key).value_or(0);
+    }
+    HASHMAP_CHECK(counter_total == kThreads * kKeysPerThread);
+    for (uint64_t key = kCounters; key < kCounters + kThreads * kKeysPerThread; ++key) {
+        uint64_t ind = (key - kCounters) / kThreads;
+        std::optional<uint64_t> value = map.find(key);
+        HASHMAP_CHECK(ind % 3 == 0 ? !value : value && *value == 2 * key);
+    }
+}
+
+// A writer keeps replacing a shared object and retiring the old one, while readers pinned
+// with guards read it; the objects count their live instances.
+void TestEpochDomain() {
+    struct Object {
+        explicit Object(std::atomic<int>& live, const uint64_t value) :
+                live(live), value(value) {
+            live.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        ~Object() {
+            live.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        std::atomic<int>& live;
+        const uint64_t value;
+    };
+
+    std::atomic<int> live{0};
+    {
+        EpochDomain domain;
+        std::atomic<Object*> current{new Object(live, 0)};
+        std::atomic<bool> done{false};
+        std::thread writer([&]() {
+            for (uint64_t value = 1; value <= 2000; ++value) {
+                Object* old = current.exchange(new Object(live, value),
+                                               std::memory_order_acq_rel);
+                domain.retire(std::shared_ptr<void>(std::shared_ptr<Object>(old)));
+            }
+            done.store(true, std::memory_order_release);
+        });
+        RunThreads(kThreads - 1, [&](size_t) {
+            uint64_t last_value = 0;
+            while (!done.load(std::memory_order_acquire)) {
+                EpochDomain::Guard guard(domain);
+                uint64_t value = current.load(std::memory_order_acquire)->value;
+                HASHMAP_CHECK(value >= last_value);
+                last_value = value;
+            }
+        });
+        writer.join();
+        domain.reclaim();
+        HASHMAP_CHECK(domain.retired_count() == 0);
+        delete current.load(std::memory_order_relaxed);
+    }
+    HASHMAP_CHECK(live.load() == 0);
+}
+
+// More threads than the map has reader slots: the rest pin through the overflow counter,
+// and operations proceed as usual.
+void TestEpochDomainOverflow() {
+    LockFreeHashMap<uint64_t, uint64_t> map(4, IntegerHash<uint64_t>(), 1);
+    RunThreads(kThreads, [&map](size_t thread) {
+        for (uint64_t ind = 0; ind < kKeysPerThread; ++ind) {
+            uint64_t key = ind * kThreads + thread;
+            HASHMAP_CHECK(map.insert(key, key));
+            HASHMAP_CHECK(map.find(key) == key);
+        }
+    });
+    for (uint64_t key = 0; key < kThreads * kKeysPerThread; ++key) {
+        HASHMAP_CHECK(map.find(key) == key);
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestConcurrentHashMap<std::hash<uint64_t>>();
+    TestConcurrentHashMap<FastHash<uint64_t>>();
+    TestSeqlockHashMap();
+    TestSnapshotHashMap();
+    TestLockFreeHashMap();
+    TestLockFreeHashMapValueRange();
+    TestStripedHashMap();
+    TestEpochDomain();
+    TestEpochDomainOverflow();
+    return 0;
+}
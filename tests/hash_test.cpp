@@ -0,0 +1,127 @@
+/*
+ * Tests of the bundled hash functions: WyHash must keep depending on the seed whatever
+ * the input is, keys that collide under one seed must spread after a reseed, and
+ * IntegerHash::HashBatch must agree with the scalar operator() on every target.
+ * Build with -mavx2 or -mavx512f -mavx512dq to cover the vectorized paths of HashBatch.
+ */
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "hash.h"
+#include "test_check.h"
+
+namespace {
+
+// Strings of the given size (at least 9 bytes) that differ only in an index stored after
+// the first word WyHash multiplies; the bytes of that word are set so that it is xor-ed
+// to zero.
+std::vector<std::string> ZeroOperandStrings(const size_t size, const size_t count) {
+    std::vector<std::string> keys;
+    const uint64_t secret = WyHash::kSecret1;
+    for (uint64_t ind = 0; ind < count; ++ind) {
+        std::string key(size, 'x');
+        if (size > 16) {
+            // The first 16-byte block is absorbed as Mum(word0 ^ kSecret1, word1 ^ seed).
+            std::memcpy(&key[0], &secret, sizeof(secret));
+            std::memcpy(&key[8], &ind, sizeof(ind));
+        } else {
+            // Strings of 9..16 bytes start with (word32 at 0) << 32 | (word32 at 8).
+            uint32_t high = static_cast<uint32_t>(secret >> 32);
+            uint32_t low = static_cast<uint32_t>(secret);
+            uint32_t index = static_cast<uint32_t>(ind);
+            std::memcpy(&key[0], &high, sizeof(high));
+            std::memcpy(&key[4], &index, sizeof(index));
+            std::memcpy(&key[8], &low, sizeof(low));
+        }
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+// A zero operand must not wipe the seed: otherwise all such strings collide with each other
+// under every seed, so reseeding can't break up a flood of them.
+void TestWyHashZeroOperand() {
+    for (size_t size : {16, 40, 100}) {
+        std::vector<std::string> keys = ZeroOperandStrings(size, 16);
+        for (uint64_t seed : {1, 2}) {
+            std::unordered_set<uint64_t> hashes;
+            for (const std::string& key : keys) {
+                hashes.insert(WyHash::Hash(key.data(), key.size(), seed));
+            }
+            HASHMAP_CHECK(hashes.size() == keys.size());
+        }
+        HASHMAP_CHECK(WyHash::Hash(keys[0].data(), size, 1) !=
+                      WyHash::Hash(keys[0].data(), size, 2));
+    }
+}
+
+// Keys picked to share a bucket under one seed, as an attacker who knows the seed would
+// pick them, land in distinct buckets after HashMap reseeds the hash function.
+void TestFastHashReseed() {
+    const size_t kBuckets = 1 << 12;
+    const size_t kColliding = 8;
+    FastHash<std::string> hash(1);
+    size_t bucket = hash("key-0") % kBuckets;
+    std::vector<std::string> colliding;
+    for (uint64_t ind = 0; colliding.size() < kColliding; ++ind) {
+        std::string key = "key-" + std::to_string(ind);
+        if (hash(key) % kBuckets == bucket) {
+            colliding.push_back(key);
+        }
+    }
+    FastHash<std::string> reseeded = hash.WithSeed(2);
+    std::unordered_set<size_t> buckets;
+    for (const std::string& key : colliding) {
+        buckets.insert(reseeded(key) % kBuckets);
+    }
+    HASHMAP_CHECK(buckets.size() == kColliding);
+}
+
+// Keys cover the whole range of KeyType, including negative values that must be sign-extended
+// like static_cast<uint64_t> does. Counts that aren't multiples of the vector width check
+// the scalar tail.
+template<class KeyType>
+void TestHashBatch() {
+    const size_t kMaxCount = 37;
+    std::vector<KeyType> keys;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t ind = 0; ind < kMaxCount; ++ind) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        keys.push_back(static_cast<KeyType>(state >> 17));
+    }
+    keys[0] = std::numeric_limits<KeyType>::min();
+    keys[1] = std::numeric_limits<KeyType>::max();
+    keys[2] = 0;
+    keys[3] = static_cast<KeyType>(-1);
+    for (uint64_t seed : {0, 0x5bd1e995}) {
+        IntegerHash<KeyType> hash(seed);
+        for (size_t count = 0; count <= kMaxCount; ++count) {
+            std::vector<size_t> hashes(count + 1, 0);
+            hash.HashBatch(keys.data(), count, hashes.data());
+            for (size_t ind = 0; ind < count; ++ind) {
+                HASHMAP_CHECK(hashes[ind] == hash(keys[ind]));
+            }
+            HASHMAP_CHECK(hashes[count] == 0);
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestWyHashZeroOperand();
+    TestFastHashReseed();
+    TestHashBatch<int8_t>();
+    TestHashBatch<uint8_t>();
+    TestHashBatch<int16_t>();
+    TestHashBatch<uint16_t>();
+    TestHashBatch<int32_t>();
+    TestHashBatch<uint32_t>();
+    TestHashBatch<int64_t>();
+    TestHashBatch<uint64_t>();
+    return 0;
+}
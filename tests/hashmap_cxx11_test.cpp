@@ -0,0 +1,66 @@
+/*
+ * hashtable.h and hash.h must stay usable from C++11 code (the concurrent wrappers need
+ * C++17). This test is compiled as C++11 and touches every part of HashMap that is
+ * instantiated only on use.
+ */
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "hashtable.h"
+#include "test_check.h"
+
+namespace {
+
+struct PoorHash {
+    size_t operator()(const int key) const {
+        return static_cast<size_t>(key % 3);
+    }
+};
+
+}  // namespace
+
+int main() {
+    HashMap<int, int> map;
+    map[1] = 2;
+    map.insert({2, 3});
+    map.emplace(4, 5);
+    map.try_emplace(6, 7);
+    map.insert_or_assign(8, 9);
+    map.erase(map.prehash(1));
+    HASHMAP_CHECK(map.find_batch(std::vector<int>{2, 4, 10})[2] == map.end());
+    map.rehash(100);
+    map.set_rehash_callback([](const HashMapRehashEvent&) {});
+    HASHMAP_CHECK(map.stats().element_count == 4);
+    HASHMAP_CHECK(map.memory_usage().total_bytes > 0);
+    map.clear();
+
+    std::vector<std::pair<uint64_t, int>> elements;
+    for (uint64_t key = 0; key < 100000; ++key) {
+        elements.push_back({key, 1});
+    }
+    HashMap<uint64_t, int, IntegerHash<uint64_t>> parallel(elements.begin(), elements.end(), 4);
+    parallel.set_background_rehash(true);
+    parallel.insert(elements.begin(), elements.end());
+    for (uint64_t key = 100000; key < 200000; ++key) {
+        parallel[key] = 1;
+    }
+    HASHMAP_CHECK(parallel.size() == 200000);
+
+    FastHashMap<int, int> fast;
+    fast[1] = 1;
+    HASHMAP_CHECK(fast.at(fast.prehash(1)) == 1);
+
+    HashMap<int, int, PoorHash> long_buckets;
+    for (int key = 0; key < 1000; ++key) {
+        long_buckets[key] = key;
+    }
+    HASHMAP_CHECK(long_buckets.stats().long_bucket_count > 0);
+
+    HashMap<std::string, int> strings;
+    strings["key"] = 1;
+    HASHMAP_CHECK(strings.contains("key"));
+    return 0;
+}
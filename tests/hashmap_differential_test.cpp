@@ -0,0 +1,446 @@
+/*
+ * Randomized differential test of HashMap against std::unordered_map: random sequences of
+ * insertions, assignments, erasures and lookups (plain, prehashed and batched), with
+ * occasional explicit rehashes, are applied to both maps, and their contents are compared
+ * every kCheckInterval operations. Every configuration first grows its map with
+ * insert-heavy operations, then shrinks it with erase-heavy ones, clears it and repeats.
+ * Configurations cover:
+ * - the plain rehash and the parallel one (rehash_threads > 1);
+ * - background rehash, also with string keys and with long buckets;
+ * - reseeding of a hash function that floods a few buckets;
+ * - the sorted index of long buckets, both with ordered keys and with a custom key
+ *   equality;
+ * - string keys with transparent lookups.
+ * The parallel range constructor is compared separately with insertion one by one on input
+ * full of duplicate keys.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "hash.h"
+#include "hashtable.h"
+#include "test_check.h"
+
+namespace {
+
+constexpr size_t kCheckInterval = 5000;
+
+// Seed 0 (the default) maps all keys to kFloodValues hashes, so chains quickly exceed
+// kMaxChainLength and HashMap reseeds the hash function; other seeds mix keys well.
+class FloodingHash {
+  public:
+    constexpr static uint64_t kFloodValues = 2;
+
+    explicit FloodingHash(const uint64_t seed_ = 0) : seed_(seed_) {}
+
+    size_t operator()(const uint64_t key) const {
+        return seed_ == 0 ? key % kFloodValues : IntegerHash<uint64_t>(seed_)(key);
+    }
+
+    FloodingHash WithSeed(const uint64_t seed) const {
+        return FloodingHash(seed);
+    }
+
+    uint64_t seed() const {
+        return seed_;
+    }
+
+  private:
+    uint64_t seed_;
+};
+
+// Only kValues distinct hashes and no WithSeed: buckets grow long and stay long,
+// so lookups go through the sorted index of long buckets.
+struct PoorHash {
+    constexpr static uint64_t kValues = 61;
+
+    size_t operator()(const uint64_t key) const {
+        return key % kValues;
+    }
+};
+
+// Like PoorHash, but with enough distinct hashes for maps large enough to be rehashed
+// in background.
+struct CoarseHash {
+    constexpr static uint64_t kValues = 1 << 12;
+
+    size_t operator()(const uint64_t key) const {
+        return IntegerHash<uint64_t>()(key) % kValues;
+    }
+};
+
+// Same as std::equal_to, but HashMap can't know that it agrees with operator<, so long
+// buckets scan elements with equal hashes one by one.
+struct CustomEqual {
+    bool operator()(const uint64_t first, const uint64_t second) const {
+        return first == second;
+    }
+};
+
+template<class Key>
+Key MakeKey(uint64_t value);
+
+template<>
+uint64_t MakeKey<uint64_t>(const uint64_t value) {
+    return value;
+}
+
+template<>
+std::string MakeKey<std::string>(const uint64_t value) {
+    return "key-" + std::to_string(value);
+}
+
+enum class Phase {
+    kGrow,
+    kShrink
+};
+
+template<class Map>
+class DifferentialTest {
+  public:
+    using Key = typename std::decay<decltype(std::declval<Map&>().begin()->first)>::type;
+
+    DifferentialTest(Map& map, const uint64_t key_space, const uint64_t seed) :
+            map_(map), key_space_(key_space), random_(seed) {}
+
+    // Runs operations random operations of the given phase, then compares the maps.
+    void Run(const size_t operations, const Phase phase) {
+        for (size_t op = 1; op <= operations; ++op) {
+            Step(phase);
+            if (op % kCheckInterval == 0) {
+                CheckEqual();
+            }
+        }
+        CheckEqual();
+    }
+
+    // Grows the map, shrinks it, clears it and grows it again.
+    void RunCycle(const size_t operations) {
+        Run(operations, Phase::kGrow);
+        Run(operations, Phase::kShrink);
+        map_.clear();
+        reference_.clear();
+        CheckEqual();
+        Run(operations / 4, Phase::kGrow);
+    }
+
+    size_t max_size() const {
+        return max_size_;
+    }
+
+    size_t max_long_buckets() const {
+        return max_long_buckets_;
+    }
+
+  private:
+    Key RandomKey() {
+        return MakeKey<Key>(std::uniform_int_distribution<uint64_t>(0, key_space_ - 1)(random_));
+    }
+
+    uint64_t RandomValue() {
+        return random_();
+    }
+
+    void Step(const Phase phase) {
+        uint64_t choice = random_() % 100;
+        // Operations that may add elements take choice < insert_share, erasures come next.
+        uint64_t insert_share = phase == Phase::kGrow ? 60 : 20;
+        uint64_t erase_share = phase == Phase::kGrow ? 10 : 50;
+        Key key = RandomKey();
+        uint64_t value = RandomValue();
+        if (choice < insert_share) {
+            Insert(choice % 6, key, value);
+        } else if (choice < insert_share + erase_share) {
+            Erase(choice % 2, key);
+        } else if (choice == 99 && random_() % 64 == 0) {
+            map_.rehash(random_() % (2 * map_.size() + 16));
+        } else {
+            Find(choice % 5, key);
+        }
+    }
+
+    void Insert(const uint64_t kind, const Key& key, const uint64_t value) {
+        auto reference_position = reference_.find(key);
+        bool present = reference_position != reference_.end();
+        switch (kind) {
+            case 0: {
+                auto result = map_.insert({key, value});
+                HASHMAP_CHECK(result.second == !present);
+                HASHMAP_CHECK(result.first->first == key);
+                reference_.insert({key, value});
+                break;
+            }
+            case 1: {
+                auto result = map_.emplace(key, value);
+                HASHMAP_CHECK(result.second == !present);
+                reference_.emplace(key, value);
+                break;
+            }
+            case 2: {
+                auto result = map_.try_emplace(key, value);
+                HASHMAP_CHECK(result.second == !present);
+                reference_.emplace(key, value);
+                break;
+            }
+            case 3: {
+                auto result = map_.insert_or_assign(key, value);
+                HASHMAP_CHECK(result.second == !present);
+                HASHMAP_CHECK(result.first->second == value);
+                reference_[key] = value;
+                break;
+            }
+            case 4:
+                map_[key] += value;
+                reference_[key] += value;
+                break;
+            default: {
+                auto prehashed = map_.prehash(key);
+                HASHMAP_CHECK(map_.try_emplace(prehashed, value).second == !present);
+                reference_.emplace(key, value);
+                break;
+            }
+        }
+        max_size_ = std::max(max_size_, map_.size());
+    }
+
+    void Erase(const uint64_t kind, const Key& key) {
+        if (kind == 0) {
+            map_.erase(key);
+        } else {
+            map_.erase(map_.prehash(key));
+        }
+        reference_.erase(key);
+        HASHMAP_CHECK(map_.size() == reference_.size());
+    }
+
+    void Find(const uint64_t kind, const Key& key) {
+        auto reference_position = reference_.find(key);
+        bool present = reference_position != reference_.end();
+        switch (kind) {
+            case 0: {
+                auto position = map_.find(key);
+                HASHMAP_CHECK((position != map_.end()) == present);
+                HASHMAP_CHECK(!present || position->second == reference_position->second);
+                break;
+            }
+            case 1:
+                HASHMAP_CHECK(map_.contains(map_.prehash(key)) == present);
+                break;
+            case 2: {
+                const Map& const_map = map_;
+                auto position = const_map.find(key);
+                HASHMAP_CHECK((position != const_map.end()) == present);
+                if (present) {
+                    HASHMAP_CHECK(const_map.at(key) == reference_position->second);
+                }
+                break;
+            }
+            case 3: {
+                std::vector<Key> keys;
+                for (size_t ind = 0; ind < 8; ++ind) {
+                    keys.push_back(RandomKey());
+                }
+                auto positions = map_.find_batch(keys);
+                for (size_t ind = 0; ind < keys.size(); ++ind) {
+                    auto expected = reference_.find(keys[ind]);
+                    HASHMAP_CHECK((positions[ind] != map_.end()) == (expected != reference_.end()));
+                    HASHMAP_CHECK(positions[ind] == map_.end() ||
+                                  positions[ind]->second == expected->second);
+                }
+                break;
+            }
+            default:
+                HASHMAP_CHECK(map_.contains(key) == present);
+                break;
+        }
+    }
+
+    void CheckEqual() {
+        HASHMAP_CHECK(map_.size() == reference_.size());
+        size_t count = 0;
+        for (auto position = map_.begin(); position != map_.end(); ++position) {
+            auto expected = reference_.find(position->first);
+            HASHMAP_CHECK(expected != reference_.end());
+            HASHMAP_CHECK(expected->second == position->second);
+            ++count;
+        }
+        HASHMAP_CHECK(count == reference_.size());
+        for (const auto& element : reference_) {
+            HASHMAP_CHECK(map_.find(element.first) != map_.end());
+        }
+        HashMapStats stats = map_.stats();
+        HASHMAP_CHECK(stats.element_count == reference_.size());
+        max_long_buckets_ = std::max(max_long_buckets_, stats.long_bucket_count);
+    }
+
+  private:
+    Map& map_;
+    uint64_t key_space_;
+    std::mt19937_64 random_;
+    std::unordered_map<Key, uint64_t> reference_;
+    size_t max_size_ = 0;
+    size_t max_long_buckets_ = 0;
+};
+
+void TestPlainRehash() {
+    HashMap<uint64_t, uint64_t> map;
+    DifferentialTest<HashMap<uint64_t, uint64_t>> test(map, 4000, 1);
+    test.RunCycle(40000);
+}
+
+void TestParallelRehash() {
+    using Map = HashMap<uint64_t, uint64_t, IntegerHash<uint64_t>>;
+    Map map;
+    map.set_rehash_threads(4);
+    DifferentialTest<Map> test(map, 1 << 17, 2);
+    test.RunCycle(120000);
+    // Parallel rehash needs at least 2 * kMinElementsPerThread elements.
+    HASHMAP_CHECK(test.max_size() >= 2 * Map::kMinElementsPerThread);
+}
+
+// Erasures and insertions made while the background thread builds the new table are
+// replayed on it, so the maps must agree after every installation.
+template<class Map>
+void TestBackgroundRehash(const uint64_t seed) {
+    Map map;
+    map.set_background_rehash(true);
+    size_t background_rehashes = 0;
+    map.set_rehash_callback([&background_rehashes](const HashMapRehashEvent& event) {
+        background_rehashes += event.background;
+    });
+    DifferentialTest<Map> test(map, 1 << 17, seed);
+    test.RunCycle(120000);
+    HASHMAP_CHECK(background_rehashes > 0);
+}
+
+void TestReseed() {
+    using Map = HashMap<uint64_t, uint64_t, FloodingHash>;
+    Map map;
+    DifferentialTest<Map> test(map, 4000, 4);
+    test.RunCycle(40000);
+    HASHMAP_CHECK(map.reseed_count() > 0);
+}
+
+// PrehashedKey computed before a reseed must still refer to its element after it; so must
+// the one of another hash map, whose FastHash has an independent seed.
+void TestPrehashedKeyAfterReseed() {
+    using Map = HashMap<uint64_t, uint64_t, FloodingHash>;
+    Map map;
+    const uint64_t key = 1;
+    map.insert({key, 1});
+    PrehashedKey<uint64_t> prehashed = map.prehash(key);
+    for (uint64_t other = 0; map.reseed_count() == 0; other += FloodingHash::kFloodValues) {
+        map.insert({other, 0});
+    }
+    size_t size = map.size();
+    map[prehashed] += 1;
+    HASHMAP_CHECK(map.size() == size);
+    HASHMAP_CHECK(map.at(key) == 2);
+    HASHMAP_CHECK(map.at(prehashed) == 2);
+    HASHMAP_CHECK(!map.try_emplace(prehashed, 0).second);
+    map.erase(prehashed);
+    HASHMAP_CHECK(!map.contains(key));
+    HASHMAP_CHECK(map.size() == size - 1);
+
+    FastHashMap<uint64_t, uint64_t> first;
+    FastHashMap<uint64_t, uint64_t> second;
+    first.insert({key, 1});
+    second.insert({key, 2});
+    second[first.prehash(key)] += 1;
+    HASHMAP_CHECK(second.size() == 1);
+    HASHMAP_CHECK(second.at(first.prehash(key)) == 3);
+}
+
+void TestLongBuckets() {
+    using Map = HashMap<uint64_t, uint64_t, PoorHash>;
+    Map map;
+    DifferentialTest<Map> test(map, 4000, 5);
+    test.RunCycle(40000);
+    HASHMAP_CHECK(test.max_long_buckets() > 0);
+}
+
+void TestLongBucketsCustomEqual() {
+    using Map = HashMap<uint64_t, uint64_t, PoorHash, CustomEqual>;
+    Map map;
+    DifferentialTest<Map> test(map, 4000, 6);
+    test.RunCycle(40000);
+    HASHMAP_CHECK(test.max_long_buckets() > 0);
+}
+
+void TestStringKeys() {
+    using Map = FastHashMap<std::string, uint64_t, std::equal_to<>>;
+    Map map;
+    DifferentialTest<Map> test(map, 4000, 7);
+    test.RunCycle(40000);
+    map.insert({"transparent", 1});
+    HASHMAP_CHECK(map.find(std::string_view("transparent")) != map.end());
+    HASHMAP_CHECK(map.contains("transparent"));
+}
+
+// Every key occurs many times with different values, so most elements are dropped as
+// duplicates by the worker threads. The map must keep the first occurrence of every key,
+// and data_ must be compacted: iteration (which walks data_) visits exactly the kept
+// elements in the order of their first occurrence, same as after sequential insertion.
+template<class Map>
+void TestParallelConstructorDuplicates(const uint64_t seed) {
+    const size_t kThreads = 4;
+    const size_t kElements = kThreads * Map::kMinElementsPerThread + 123;
+    const uint64_t kKeySpace = kElements / 8;
+    std::mt19937_64 random(seed);
+    std::vector<std::pair<uint64_t, uint64_t>> elements;
+    for (size_t ind = 0; ind < kElements; ++ind) {
+        elements.emplace_back(random() % kKeySpace, ind);
+    }
+    Map parallel(elements.begin(), elements.end(), kThreads);
+    Map sequential;
+    for (const auto& element : elements) {
+        sequential.insert(element);
+    }
+    HASHMAP_CHECK(parallel.size() == sequential.size());
+    auto expected = sequential.begin();
+    for (const auto& element : parallel) {
+        HASHMAP_CHECK(expected != sequential.end());
+        HASHMAP_CHECK(element == *expected);
+        ++expected;
+    }
+    HASHMAP_CHECK(expected == sequential.end());
+    for (const auto& element : sequential) {
+        HASHMAP_CHECK(parallel.at(element.first) == element.second);
+    }
+    // Indexes of the table must have been renumbered along with data_: erasures move the last
+    // element of data_ into the freed position.
+    for (uint64_t key = 0; key < kKeySpace; key += 2) {
+        parallel.erase(key);
+        sequential.erase(key);
+    }
+    HASHMAP_CHECK(parallel.size() == sequential.size());
+    for (const auto& element : sequential) {
+        HASHMAP_CHECK(parallel.at(element.first) == element.second);
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestPlainRehash();
+    TestParallelRehash();
+    TestParallelConstructorDuplicates<HashMap<uint64_t, uint64_t, IntegerHash<uint64_t>>>(10);
+    TestParallelConstructorDuplicates<HashMap<uint64_t, uint64_t, PoorHash>>(11);
+    TestBackgroundRehash<HashMap<uint64_t, uint64_t, IntegerHash<uint64_t>>>(3);
+    TestBackgroundRehash<FastHashMap<std::string, uint64_t>>(8);
+    TestBackgroundRehash<HashMap<uint64_t, uint64_t, CoarseHash>>(9);
+    TestReseed();
+    TestPrehashedKeyAfterReseed();
+    TestLongBuckets();
+    TestLongBucketsCustomEqual();
+    TestStringKeys();
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Regression tests of HashMap for bugs that random operation sequences rarely expose.
+ * Meant to be built with -D_GLIBCXX_DEBUG: then a past-the-end iterator or an out-of-range
+ * index of data_ aborts the test instead of silently reading or writing stale memory.
+ */
+#include <cstdint>
+#include <functional>
+
+#include "hashtable.h"
+#include "test_check.h"
+
+namespace {
+
+// Elements are erased in reverse order of insertion, so every erased element is the one
+// stored last in data_.
+void TestEraseLastElement() {
+    HashMap<uint64_t, uint64_t> map;
+    const uint64_t kElements = 20;
+    for (uint64_t key = 0; key < kElements; ++key) {
+        map.insert({key, key});
+    }
+    for (uint64_t key = kElements; key-- > 0;) {
+        map.erase(key);
+        HASHMAP_CHECK(map.size() == key);
+        HASHMAP_CHECK(map.find(key) == map.end());
+        for (uint64_t other = 0; other < key; ++other) {
+            HASHMAP_CHECK(map.at(other) == other);
+        }
+    }
+}
+
+// The table of a small map is already at its minimum size, so clear() doesn't rebuild it;
+// lookups and erasures after it must not see indices of the removed elements.
+void TestClearMinimumTable() {
+    HashMap<uint64_t, uint64_t> map;
+    map.insert({1, 1});
+    map.insert({2, 2});
+    map.clear();
+    HASHMAP_CHECK(map.size() == 0);
+    HASHMAP_CHECK(map.find(1) == map.end());
+    HASHMAP_CHECK(map.find(2) == map.end());
+    map.insert({2, 20});
+    map.insert({7, 70});
+    HASHMAP_CHECK(map.at(2) == 20);
+    map.erase(2);
+    HASHMAP_CHECK(map.find(2) == map.end());
+    HASHMAP_CHECK(map.at(7) == 70);
+}
+
+}  // namespace
+
+int main() {
+    TestEraseLastElement();
+    TestClearMinimumTable();
+    return 0;
+}
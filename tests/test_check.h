@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// Checks condition in every build type (unlike assert, which Release builds disable);
+// failure prints the condition and aborts the test.
+#define HASHMAP_CHECK(condition)                                                      \
+    do {                                                                              \
+        if (!(condition)) {                                                           \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,     \
+                         #condition);                                                 \
+            std::abort();                                                             \
+        }                                                                             \
+    } while (false)